@@ -110,12 +110,19 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * Drop the entries for TS_NPAGES pages from TS_VADDR on, tagged
+	 * with ASID TS_ASID, then V TS_DONE. With TS_WRITABLE set, drop
+	 * only those that allow writes.
 	 */
-	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	unsigned ts_npages;
+	unsigned ts_asid;
+	bool ts_writable;
+	struct semaphore *ts_done;
 };
 
 #define TLBSHOOTDOWN_MAX 16
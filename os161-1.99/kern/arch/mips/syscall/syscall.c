@@ -36,6 +36,10 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"		// not sure why used <> before
+#include "opt-A3.h"
+#if OPT_A3
+#include <counter.h>
+#endif
 
 /*
  * System call dispatcher.
@@ -99,6 +103,11 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
+#if OPT_A3
+	counter_inc(callno >= 0 && callno < CNT_NSYSCALLS ?
+		    CNT_SYSCALL + callno : CNT_SYSCALL_OTHER);
+#endif
+
 	switch (callno) {
 	    case SYS_reboot:
 		err = sys_reboot(tf->tf_a0);
@@ -138,6 +147,11 @@ syscall(struct trapframe *tf)
 		err = sys_execv((char*) tf->tf_a0, (char**)tf->tf_a1, (int *)&retval);	
 		break; 
 #endif
+#if OPT_A3
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+#endif
 
 	    /* Add stuff here */
  
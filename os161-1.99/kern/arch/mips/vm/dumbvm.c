@@ -32,11 +32,22 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <kmalloc.h>
+#include <kmem_cache.h>
+#include <uw-vmstats.h>
 #include <opt-A3.h>
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -51,210 +62,1224 @@
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 #if OPT_A3
-static struct spinlock cm_lock = SPINLOCK_INITIALIZER;
+/* Set once the coremap owns physical memory */
 static bool useCM = false;
-static int * cm;						// coremap 
-static paddr_t p_addr_low;				// phys addr start 
-static paddr_t p_addr_high;				// phys addr end
-static int core_size = 0;		// # of elements to be stored in coremap 
 
-// 
+/*
+ * vm_lock serializes everything that changes user page tables or
+ * frame ownership with page replacement: the slow path of vm_fault,
+ * fork, address space teardown, and eviction itself.
+ *
+ * No disk I/O is done holding it. A page being read in or written
+ * out has PTE_BUSY set and its frame pinned, and is counted in its
+ * address space's as_busy, while vm_lock is dropped. Anyone who finds
+ * it so waits on vm_cv, which is broadcast as each I/O finishes, and
+ * then looks again, since anything may have changed meanwhile. Code
+ * that works on a whole page table waits for as_busy to reach 0.
+ */
+static struct lock *vm_lock;
+static struct cv *vm_cv;
 
-#endif
-void
-vm_bootstrap(void)
+/*
+ * vm_pagefault and its helpers return this when they had to drop
+ * vm_lock and the page table changed under them; the fault is then
+ * handled again from the start.
+ */
+#define VM_AGAIN	(-1)
+
+/*
+ * Every address space, so that the owner of a frame whose sharers
+ * have gone can be found. Protected by vm_lock.
+ */
+static struct addrspace *as_all;
+
+/* V'd by each cpu as it finishes a shootdown for the evictor. */
+static struct semaphore *vm_shootsem;
+
+/*
+ * Address spaces come from an object cache; a free one keeps its
+ * (empty) page table.
+ */
+static struct kmem_cache *as_cache;
+
+static
+int
+as_ctor(void *obj)
 {
-	#if OPT_A3
+	struct addrspace *as = obj;
 
-	//how much ram you have 
-	ram_getsize(&p_addr_low, &p_addr_high); 						// lowest and highest possible physical addresses you have - not necessarily continuous? 
-	p_addr_low = ROUNDUP(p_addr_low, PAGE_SIZE); 					// make it page aligned 
-	p_addr_high = ROUNDUP(p_addr_high, PAGE_SIZE) - PAGE_SIZE;		
-		// ex 4GB and 7GB
-	
-	// chunk into frames 
-	core_size = (p_addr_high - p_addr_low)/ PAGE_SIZE;	// # possible frames, and also the # of elements in the core map 
-		// ex. cs = (3G/PAGE/SIZE )
+	as->as_pt = pt_create();
+	return as->as_pt == NULL ? ENOMEM : 0;
+}
+
+static
+void
+as_dtor(void *obj)
+{
+	struct addrspace *as = obj;
 
-	// kprintf("coresize = %d\n", core_size); 
+	pt_destroy(as->as_pt);
+}
 
-	int cm_needed_pages = ROUNDUP((sizeof(int) * core_size), PAGE_SIZE) / PAGE_SIZE ; 		// # bytes needed for CM 
-		// ex. roundup(100)/4096  = 1 
-		
-	cm = (int*) (PADDR_TO_KVADDR(p_addr_low)); 
+static int vm_evict(bool maywrite);
+#endif
 
-	// temp kmallocing 	(no actual memory given)	
-	for(int i = 0; i < cm_needed_pages; i++){
-		cm[i] = 1; 		// 1 =  in use (by coremap)
-	} 
-	for(int i = cm_needed_pages; i < core_size; i++){
-		cm[i] = 0;		// 0 = not in use (can allocate)
+void
+vm_bootstrap(void)
+{
+#if OPT_A3
+	/* Hand all remaining physical memory to the page allocator. */
+	coremap_bootstrap();
+	useCM = true;
+	kmalloc_bootstrap();
+	vmstats_init();
+
+	vm_lock = lock_create("vm");
+	vm_cv = cv_create("vm");
+	vm_shootsem = sem_create("vm shootdown", 0);
+	if (vm_lock == NULL || vm_cv == NULL || vm_shootsem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
 	}
-	
-	useCM = true; 
+	swap_bootstrap();
 
-	#else
+	as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace),
+				     as_ctor, as_dtor);
+	if (as_cache == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+#else
 	/* Do nothing. */
-	#endif
+#endif
+}
+
+#if !OPT_A3
+void
+vm_printtlbstats(void)
+{
+	kprintf("dumbvm flushes the TLB on every address space switch.\n");
 }
+#endif
 
-// DRAW STACK AND EVERYTHING 
+void
+vm_shutdown(void)
+{
+#if OPT_A3
+	vmstats_print();
+#endif
+}
 
 static
 paddr_t
-getppages(unsigned long npages)		//getppages(1)
+getppages(unsigned long npages)
 {
 	paddr_t addr;
+
 #if OPT_A3
-	// use RAM_STEALMEM since coremap has not been initialized yet 
-	if(useCM == false){
+	if (useCM) {
+		return coremap_alloc(npages);
+	}
+#endif
+	/* Before vm_bootstrap, take memory directly from ram.c. */
+	spinlock_acquire(&stealmem_lock);
+	addr = ram_stealmem(npages);
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
 
-		spinlock_acquire(&stealmem_lock);
-		addr = ram_stealmem(npages);
-		spinlock_release(&stealmem_lock);	
-		return addr; 	
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+#if OPT_A3
+	/*
+	 * Page tables and the like allocated under vm_lock can make
+	 * room by dropping clean pages; writing pages out would mean
+	 * letting go of vm_lock in the middle of the caller's work.
+	 * Elsewhere the caller may hold locks the pager needs, so it
+	 * is on its own.
+	 */
+	while (pa == 0 && npages == 1 && vm_lock != NULL &&
+	       lock_do_i_hold(vm_lock) && vm_evict(false) == 0) {
+		pa = getppages(npages);
 	}
-	
-	// else: start using the coremap to allocated physical memory	
-	spinlock_acquire(&cm_lock);
-	addr = 0;
-	// kprintf("looking for %d pages from COREMAP\n", (int)npages);
+	/* Free blocks cached by kmalloc may add up to whole pages. */
+	if (pa == 0 && kmags_drain() > 0) {
+		pa = getppages(npages);
+	}
+#endif
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+#if OPT_A3
+	if (useCM) {
+		coremap_free(KVADDR_TO_PADDR(addr));
+	}
+#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+#endif
+}
+
+#if !OPT_A3
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+#endif
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+#if OPT_A3
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of their address space, so
+ * switching address spaces needs no flush. ASIDs are handed out in
+ * order within a generation and never reused in it; when they run
+ * out a new generation starts and every address space gets a new
+ * ASID the next time it is activated. Each cpu flushes its TLB the
+ * first time it activates an address space from a newer generation
+ * than its TLB contents, so that's the only time flushing happens.
+ *
+ * An address space also records in as_cpus, a bit per cpu number,
+ * which cpus have activated it since it got its ASID. Only those can
+ * hold entries for it, so only those are sent shootdowns.
+ *
+ * ASID 0 is never handed out, so the entries written to invalidate
+ * the TLB can't match anything.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;	/* current generation */
+static unsigned asid_next = 1;		/* next free ASID in it */
+
+/* Statistics, protected by asid_lock */
+static unsigned asid_allocs;		/* ASIDs handed out */
+static unsigned asid_rollovers;		/* generations started */
+static unsigned tlb_flushes;		/* whole-TLB flushes */
+
+/*
+ * Invalidate this cpu's whole TLB. Slots are then handed out in
+ * order, and once they are all used, replaced round-robin; the
+ * per-cpu counts stand in for probing with tlb_read.
+ *
+ * Leaves EntryHi's ASID clobbered; the caller resets it.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlbused = 0;
+	curcpu->c_tlbnext = 0;
+	splx(spl);
+
+	tlb_flushes++;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
 
-	/***** cm_stealmem *****/ 
-	// find a place in coremap to put npages continous pages (and label them in the coremap) 
-	for(int i = 0; i < core_size; i++){
-		
-		if (cm[i] == 0){
+/*
+ * Make AS the address space seen by this cpu's MMU.
+ */
+static
+void
+as_setasid(struct addrspace *as)
+{
+	uint32_t self;
+	int spl;
 
+	/* Stay on this cpu. */
+	spl = splhigh();
 
-			unsigned int numPages= 1;
+	KASSERT(curcpu->c_number < 32);
+	self = (uint32_t)1 << curcpu->c_number;
 
-			if(numPages == npages){
+	/*
+	 * as_cpus only changes under asid_lock, and vm_unmap reads it
+	 * under asid_lock, so a cpu is in it before it can load any
+	 * entry vm_shootdown would have to reach.
+	 */
+	if (as->as_asidgen != asid_generation ||
+	    curcpu->c_asidgen != asid_generation ||
+	    (as->as_cpus & self) == 0) {
+		spinlock_acquire(&asid_lock);
+		if (as->as_asidgen != asid_generation) {
+			if (asid_next == NUM_ASID) {
+				asid_generation++;
+				asid_next = 1;
+				asid_rollovers++;
+			}
+			as->as_asid = asid_next++;
+			as->as_asidgen = asid_generation;
+			as->as_cpus = 0;
+			asid_allocs++;
+		}
+		as->as_cpus |= self;
+		if (curcpu->c_asidgen != asid_generation) {
+			vm_tlbflush();
+			curcpu->c_asidgen = asid_generation;
+		}
+		spinlock_release(&asid_lock);
+	}
 
-				// label coremap with values of 1,2,3...., until npages are all labeled
-				addr = p_addr_low + (PAGE_SIZE * i); 	// the start of physical addr of the npages  
+	curcpu->c_asid = as->as_asid;
+	tlb_setasid(as->as_asid);
+	splx(spl);
+}
 
-				cm[i] = 1;	// label coremap 
-				// kprintf("found 1 page at %x, putting into coremap[%d]\n",addr, i);
+/*
+ * Drop this cpu's entries for the pages in TS. For a long range, or
+ * for only the writable entries, reading each TLB slot is cheaper
+ * than probing for each page.
+ */
+static
+void
+vm_tlbinvalidate(const struct tlbshootdown *ts)
+{
+	uint32_t ehi, elo;
+	vaddr_t end;
+	unsigned n;
+	int i, spl;
 
-				spinlock_release(&cm_lock);
-				return addr;	
+	spl = splhigh();
+	if (ts->ts_writable || ts->ts_npages > NUM_TLB) {
+		end = ts->ts_vaddr + ts->ts_npages * PAGE_SIZE;
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) == 0 ||
+			    (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT != ts->ts_asid ||
+			    (ehi & TLBHI_VPAGE) < ts->ts_vaddr ||
+			    (ehi & TLBHI_VPAGE) >= end ||
+			    (ts->ts_writable && (elo & TLBLO_DIRTY) == 0)) {
+				continue;
 			}
-			
-			for(int endIndex = i+1; endIndex < core_size; endIndex++){
-				
-				if(cm[endIndex] != 0){
-					break; 
-				}
-							
-				numPages++; 
-				// kprintf("%d\n", numPages);
-				if(numPages == npages){		// found a continuous  block of npages free 
-					addr = p_addr_low + (PAGE_SIZE * i); 	// the start of physical addr of the npages  
-					// kprintf("found %x\n",addr);
-
-					// label coremap with values of 1,2,3...., until npages are all labeled
-					for(unsigned int k = 1; k <= npages; k++){
-						cm[i] = k;			// cm[3] = 1, cm[4] = 2, cm[5] = 3
-						i++; 				// not technically the startAddr anymore (as it is incremented)
-					}
-				// kprintf("found a sequence of %d free pages at %x, puttin into coremap[?] to coremap[%d]\n",numPages, addr, i); 
-
-					spinlock_release(&cm_lock);
-					return addr;	
-				}
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	else {
+		for (n=0; n<ts->ts_npages; n++) {
+			i = tlb_probe((ts->ts_vaddr + n * PAGE_SIZE) |
+				      (ts->ts_asid << TLBHI_PIDSHIFT), 0);
+			if (i >= 0) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+	}
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlbinvalidate(ts);
+	V(ts->ts_done);
+}
+
+/*
+ * Shootdowns are only sent under vm_lock, one to each cpu at a time,
+ * so the queue never overflows into this and every one is answered
+ * by vm_tlbshootdown.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	spinlock_acquire(&asid_lock);
+	vm_tlbflush();
+	spinlock_release(&asid_lock);
+	tlb_setasid(curcpu->c_asid);
+}
+
+void
+vm_printtlbstats(void)
+{
+	unsigned gen, allocs, rollovers, flushes;
+
+	spinlock_acquire(&asid_lock);
+	gen = asid_generation;
+	allocs = asid_allocs;
+	rollovers = asid_rollovers;
+	flushes = tlb_flushes;
+	spinlock_release(&asid_lock);
+
+	kprintf("ASID generation %u: %u ASIDs allocated, %u rollovers, "
+		"%u TLB flushes\n", gen, allocs, rollovers, flushes);
+}
+
+/*
+ * Load a translation for VADDR in AS into this cpu's TLB. If REPLACE
+ * is set the page may already have an entry (a write to a read-only
+ * page), which is overwritten in place.
+ */
+static
+void
+vm_tlbload(struct addrspace *as, vaddr_t vaddr, uint32_t elo, bool replace)
+{
+	struct cpu *c;
+	uint32_t ehi;
+	int i, spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	/* Read the ASID here, so a switch can't have changed it. */
+	ehi = vaddr | (as->as_asid << TLBHI_PIDSHIFT);
+
+	if (replace) {
+		i = tlb_probe(ehi, 0);
+		if (i >= 0) {
+			tlb_write(ehi, elo, i);
+			splx(spl);
+			return;
+		}
+	}
+
+	if (c->c_tlbused < NUM_TLB) {
+		tlb_write(ehi, elo, c->c_tlbused++);
+		splx(spl);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		return;
+	}
+
+	tlb_write(ehi, elo, c->c_tlbnext);
+	c->c_tlbnext = (c->c_tlbnext + 1) % NUM_TLB;
+	splx(spl);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+}
+
+/*
+ * Software TLB.
+ */
+static
+void
+as_swtlb_flush(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i=0; i<SWTLB_SIZE; i++) {
+		as->as_swtlb[i].st_vaddr = 0;
+		as->as_swtlb[i].st_elo = 0;
+	}
+}
+
+static
+inline
+struct swtlb_entry *
+as_swtlb_slot(struct addrspace *as, vaddr_t vaddr)
+{
+	return &as->as_swtlb[(vaddr / PAGE_SIZE) % SWTLB_SIZE];
+}
+
+/*
+ * Answer a TLB miss from the software TLB, if it has the page. The
+ * evictor clears an entry before shooting the page down, so checking
+ * and loading with interrupts off can't load a page being evicted:
+ * either we see the cleared entry, or the shootdown follows our load.
+ */
+static
+bool
+vm_swtlbload(struct addrspace *as, vaddr_t vaddr)
+{
+	struct swtlb_entry *st;
+	bool hit;
+	int spl;
+
+	spl = splhigh();
+	st = as_swtlb_slot(as, vaddr);
+	hit = st->st_elo != 0 && st->st_vaddr == vaddr;
+	if (hit) {
+		vm_tlbload(as, vaddr, st->st_elo, false);
+	}
+	splx(spl);
+	return hit;
+}
+
+/*
+ * Page replacement.
+ *
+ * When memory runs short, vm_evict takes a victim from the coremap's
+ * clock. A clean page, one not written since it was paged in, still
+ * matches the executable, zeros, or the swap slot it came from, so it
+ * is just dropped and paged in again from there if needed. Writable
+ * pages are mapped read-only until first written to make this work.
+ * A dirty victim and the dirty pages following it in the same address
+ * space, up to SWAP_CLUSTER of them, are written to consecutive swap
+ * slots in one I/O, and their page table entries are pointed at the
+ * slots.
+ *
+ * Their TLB entries are shot down on every cpu first, so they can't
+ * change while they go out. The write itself is done with vm_lock
+ * dropped and the pages marked busy, so they can't be faulted back
+ * in, shared or freed meanwhile either.
+ */
+
+/*
+ * Frames kept free for the kernel, whose allocations mostly can't
+ * evict. User pages start being evicted when fewer are left.
+ */
+#define VM_RESERVE	32
+
+/*
+ * Drop the TLB entries of AS described by TS (whose ASID and
+ * semaphore are filled in here) on every cpu that may hold them, and
+ * wait until they are gone. The caller has already removed them from
+ * the software TLB.
+ */
+static
+void
+vm_shootdown(struct addrspace *as, struct tlbshootdown *ts)
+{
+	struct cpu *c, *self;
+	uint32_t cpus;
+	unsigned i, nsent;
+	int spl;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	/* Stay on this cpu while telling the others. */
+	nsent = 0;
+	spl = splhigh();
+	self = curcpu->c_self;
+	spinlock_acquire(&asid_lock);
+	ts->ts_asid = as->as_asid;
+	cpus = as->as_cpus;
+	spinlock_release(&asid_lock);
+	ts->ts_done = vm_shootsem;
+
+	vm_tlbinvalidate(ts);
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		if (c != self && (cpus & ((uint32_t)1 << c->c_number))) {
+			ipi_tlbshootdown(c, ts);
+			nsent++;
+		}
+	}
+	splx(spl);
+
+	while (nsent-- > 0) {
+		P(vm_shootsem);
+	}
+}
+
+/*
+ * Remove NPAGES pages of AS from VADDR on from the software TLB and
+ * from the TLB of every cpu that has run AS.
+ */
+static
+void
+vm_unmap(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts;
+	struct swtlb_entry *st;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	if (npages < SWTLB_SIZE) {
+		for (i=0; i<npages; i++) {
+			st = as_swtlb_slot(as, vaddr + i * PAGE_SIZE);
+			if (st->st_vaddr == vaddr + i * PAGE_SIZE) {
+				st->st_elo = 0;
+				st->st_vaddr = 0;
 			}
 		}
-		// if cm[i] != 0 then used. go onto next i available (i++)
 	}
-	/***** cm_stealmem   *****/ 
-
-	spinlock_release(&cm_lock);
-	// kprintf("not found\n");
-	return addr;	
-	/***** CM_USE END  *****/ 
-
-#else 
-	spinlock_acquire(&stealmem_lock);
-	addr = ram_stealmem(npages);
-	spinlock_release(&stealmem_lock);
-	return addr;
-#endif
+	else {
+		for (i=0; i<SWTLB_SIZE; i++) {
+			st = &as->as_swtlb[i];
+			if (st->st_vaddr >= vaddr &&
+			    st->st_vaddr - vaddr < npages * PAGE_SIZE) {
+				st->st_elo = 0;
+				st->st_vaddr = 0;
+			}
+		}
+	}
+
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	ts.ts_writable = false;
+	vm_shootdown(as, &ts);
+}
+
+/*
+ * Take away write access to every page of AS, in the software TLB
+ * and in the TLB of every cpu that has run AS. The next write to each
+ * page faults and finds out from the page table what to do.
+ */
+static
+void
+vm_unmapwritable(struct addrspace *as)
+{
+	struct tlbshootdown ts;
+	struct swtlb_entry *st;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (i=0; i<SWTLB_SIZE; i++) {
+		st = &as->as_swtlb[i];
+		if (st->st_elo & TLBLO_DIRTY) {
+			st->st_elo = 0;
+			st->st_vaddr = 0;
+		}
+	}
+
+	ts.ts_vaddr = 0;
+	ts.ts_npages = USERSPACETOP / PAGE_SIZE;
+	ts.ts_writable = true;
+	vm_shootdown(as, &ts);
+}
+
+/*
+ * Drop vm_lock for I/O on NPAGES pages of AS, which the caller has
+ * marked busy, and take it back afterwards.
+ */
+static
+void
+as_iostart(struct addrspace *as, unsigned npages)
+{
+	as->as_busy += npages;
+	lock_release(vm_lock);
+}
+
+static
+void
+as_iodone(struct addrspace *as, unsigned npages)
+{
+	lock_acquire(vm_lock);
+	KASSERT(as->as_busy >= npages);
+	as->as_busy -= npages;
+	cv_broadcast(vm_cv, vm_lock);
+}
+
+/*
+ * Wait until AS has no pages in transit, so the whole page table can
+ * be worked on.
+ */
+static
+void
+as_waitidle(struct addrspace *as)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	while (as->as_busy > 0) {
+		cv_wait(vm_cv, vm_lock);
+	}
+}
+
+/*
+ * Find the address space that maps the frame PADDR at VADDR, for a
+ * frame that was shared and has one reference left, which the
+ * coremap doesn't know the owner of. Sharers map a frame at the same
+ * address, so one lookup per address space does it.
+ */
+static
+struct addrspace *
+vm_findowner(paddr_t paddr, vaddr_t vaddr)
+{
+	struct addrspace *as;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	for (as = as_all; as != NULL; as = as->as_next) {
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL && (*pte & PTE_SWAPPED) == 0 &&
+		    (*pte & PTE_FRAME) == paddr) {
+			return as;
+		}
+	}
+	panic("vm_findowner: nobody maps 0x%x at 0x%x\n", paddr, vaddr);
+	return NULL;
+}
+
+/*
+ * Evict at least one page. Unless MAYWRITE is set only clean pages
+ * are taken, and vm_lock is held throughout; otherwise it is dropped
+ * while pages are written. Returns ENOMEM if no page can be evicted,
+ * or an error from swap.
+ */
+static
+int
+vm_evict(bool maywrite)
+{
+	struct addrspace *as;
+	vaddr_t vaddr, va;
+	paddr_t paddrs[SWAP_CLUSTER];
+	pte_t *ptes[SWAP_CLUSTER];
+	unsigned i, n, slot;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	paddrs[0] = coremap_victim(&as, &vaddr, !maywrite);
+	if (paddrs[0] == 0) {
+		return ENOMEM;
+	}
+	if (as == NULL) {
+		as = vm_findowner(paddrs[0], vaddr);
+	}
+	ptes[0] = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(ptes[0] != NULL && (*ptes[0] & PTE_FRAME) == paddrs[0]);
+
+	if (!coremap_isdirty(paddrs[0])) {
+		/* Clean; it can be read in again from where it came. */
+		vm_unmap(as, vaddr, 1);
+		slot = coremap_takeslot(paddrs[0]);
+		*ptes[0] = slot == CM_NOSLOT ? 0 :
+			PTE_MKSWAP(slot) | (*ptes[0] & PTE_WRITE);
+		coremap_free(paddrs[0]);
+		return 0;
+	}
+
+	/* Take the dirty pages that follow it along. */
+	for (n=1; n<SWAP_CLUSTER; n++) {
+		va = vaddr + n * PAGE_SIZE;
+		if (va >= USERSPACETOP) {
+			break;
+		}
+		ptes[n] = pt_lookup(as->as_pt, va, false);
+		if (ptes[n] == NULL ||
+		    (*ptes[n] & (PTE_WRITE | PTE_SWAPPED | PTE_BUSY)) !=
+		    PTE_WRITE) {
+			break;
+		}
+		paddrs[n] = *ptes[n] & PTE_FRAME;
+		if (!coremap_evictable(paddrs[n], as, va) ||
+		    !coremap_isdirty(paddrs[n])) {
+			break;
+		}
+	}
+
+	/* This may give us fewer slots than pages; send what fits. */
+	result = swap_alloc(&slot, &n);
+	if (result) {
+		return result;
+	}
+
+	vm_unmap(as, vaddr, n);
+	for (i=0; i<n; i++) {
+		*ptes[i] |= PTE_BUSY;
+		coremap_pin(paddrs[i]);
+	}
+	as_iostart(as, n);
+	result = swap_write(slot, paddrs, n);
+	as_iodone(as, n);
+
+	/* The address space waited for us, so as and ptes are still good. */
+	for (i=0; i<n; i++) {
+		KASSERT(*ptes[i] == (paddrs[i] | PTE_WRITE | PTE_BUSY));
+		if (result) {
+			/* Put it back as it was. */
+			*ptes[i] = paddrs[i] | PTE_WRITE;
+			coremap_setowner(paddrs[i], as, vaddr + i * PAGE_SIZE);
+			swap_free(slot + i);
+			continue;
+		}
+		*ptes[i] = PTE_MKSWAP(slot + i) | PTE_WRITE;
+		coremap_free(paddrs[i]);
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
+
+/*
+ * Get a frame for a user page, evicting to make room if need be,
+ * which may drop vm_lock for a while. Returns 0 if nothing more can
+ * be evicted.
+ */
+static
+paddr_t
+vm_getframe(void)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	if (coremap_nfree() < VM_RESERVE) {
+		(void)vm_evict(true);
+	}
+
+	paddr = getppages(1);
+	while (paddr == 0 && vm_evict(true) == 0) {
+		paddr = getppages(1);
+	}
+	return paddr;
+}
+
+/*
+ * The stack starts out DUMBVM_STACKPAGES long and grows down on
+ * demand, up to STACK_MAXPAGES or until it would meet the heap.
+ */
+#define STACK_MAXPAGES	1024
+
+/*
+ * Find the region containing VADDR. A fault just below the stack
+ * grows the stack to cover it.
+ */
+static
+struct as_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *ar, *stack;
+	vaddr_t floor;
+
+	for (ar = as->as_regions; ar != NULL; ar = ar->ar_next) {
+		if (vaddr >= ar->ar_base &&
+		    vaddr < ar->ar_base + ar->ar_npages * PAGE_SIZE) {
+			return ar;
+		}
+	}
+
+	stack = as->as_stack;
+	if (stack == NULL || vaddr >= stack->ar_base) {
+		return NULL;
+	}
+	floor = USERSTACK - STACK_MAXPAGES * PAGE_SIZE;
+	if (as->as_heap != NULL) {
+		/* Keep a guard page between the heap and the stack. */
+		vaddr_t heaptop = as->as_heap->ar_base +
+			(as->as_heap->ar_npages + 1) * PAGE_SIZE;
+		if (heaptop > floor) {
+			floor = heaptop;
+		}
+	}
+	if (vaddr < floor) {
+		return NULL;
+	}
+
+	stack->ar_npages += (stack->ar_base - vaddr) / PAGE_SIZE;
+	stack->ar_base = vaddr;
+	return stack;
+}
+
+/*
+ * Work out which part of the page at VADDR region AR's file image
+ * covers, as [*LO, *HI). Returns false if none of it does.
+ */
+static
+bool
+as_filepart(struct addrspace *as, struct as_region *ar, vaddr_t vaddr,
+	    vaddr_t *lo, vaddr_t *hi)
+{
+	*lo = vaddr > ar->ar_fvaddr ? vaddr : ar->ar_fvaddr;
+	*hi = vaddr + PAGE_SIZE < ar->ar_fvaddr + ar->ar_fsize ?
+		vaddr + PAGE_SIZE : ar->ar_fvaddr + ar->ar_fsize;
+	return as->as_file != NULL && *lo < *hi;
+}
+
+/*
+ * Read [LO, HI) of region AR's file image, part of the page at VADDR,
+ * into the frame at PADDR.
+ */
+static
+int
+as_readpage(struct addrspace *as, struct as_region *ar,
+	    paddr_t paddr, vaddr_t vaddr, vaddr_t lo, vaddr_t hi)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (lo - vaddr)),
+		  hi - lo, ar->ar_foffset + (lo - ar->ar_fvaddr), UIO_READ);
+	result = VOP_READ(as->as_file, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("dumbvm: short read on page - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * Fill in a page on first touch: take a zeroed frame and read in
+ * whatever part of the executable belongs there. On success the
+ * frame is entered in *PTE with the region's permissions.
+ */
+static
+int
+as_pagein(struct addrspace *as, struct as_region *ar,
+	  vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t paddr;
+	vaddr_t lo, hi;
+	int result;
+
+	paddr = vm_getframe();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	if (*pte != 0) {
+		/* Filled in while we waited for the frame. */
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return VM_AGAIN;
+	}
+	as_zero_region(paddr, 1);
+
+	if (as_filepart(as, ar, vaddr, &lo, &hi)) {
+		*pte = PTE_BUSY;
+		as_iostart(as, 1);
+		result = as_readpage(as, ar, paddr, vaddr, lo, hi);
+		as_iodone(as, 1);
+		*pte = 0;
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+	else {
+		/* Pure BSS, heap or stack; zeros are all it needs. */
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+
+	*pte = paddr;
+	if (ar->ar_perms & AR_WRITE) {
+		*pte |= PTE_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * Read a swapped-out page back into a new frame. The frame keeps the
+ * slot until the page is written, so that until then it can be
+ * evicted again without writing it out.
+ */
+static
+int
+as_swapin(struct addrspace *as, pte_t *pte)
+{
+	paddr_t paddr;
+	pte_t old;
+	int result;
+
+	old = *pte;
+	paddr = vm_getframe();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	if (*pte != old) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return VM_AGAIN;
+	}
+
+	*pte = old | PTE_BUSY;
+	as_iostart(as, 1);
+	result = swap_read(PTE_SLOT(old), paddr);
+	as_iodone(as, 1);
+	*pte = old;
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+
+	/* The entry's reference to the slot passes to the frame. */
+	coremap_setslot(paddr, PTE_SLOT(old));
+	*pte = paddr | (old & PTE_WRITE);
+	return 0;
+}
+
+/*
+ * Write to a copy-on-write page: give this address space its own
+ * copy of the frame in *PTE, unless it already holds the only
+ * reference, in which case the frame can simply be written.
+ */
+static
+int
+as_unshare(pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+	pte_t old;
+
+	old = *pte;
+	oldpa = old & PTE_FRAME;
+	if (coremap_refcount(oldpa) == 1) {
+		return 0;
+	}
+
+	newpa = vm_getframe();
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	if (*pte != old) {
+		free_kpages(PADDR_TO_KVADDR(newpa));
+		return VM_AGAIN;
+	}
+	if (coremap_refcount(oldpa) == 1) {
+		/* The other sharers went while we waited. */
+		free_kpages(PADDR_TO_KVADDR(newpa));
+		return 0;
+	}
+
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa),
+		PAGE_SIZE);
+	/* Nothing else has this copy; vm_pagefault marks it dirty. */
+	*pte = newpa | (old & ~PTE_FRAME);
+
+	/* Drop our reference to the shared frame. */
+	free_kpages(PADDR_TO_KVADDR(oldpa));
+	return 0;
+}
+
+/*
+ * The part of vm_fault that goes to the page table, called with
+ * vm_lock held. Returns VM_AGAIN if it has to be called again.
+ */
+static
+int
+vm_pagefault(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	struct as_region *ar;
+	struct swtlb_entry *st;
+	pte_t *pte;
+	paddr_t paddr;
+	uint32_t elo;
+	unsigned slot;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	/*
+	 * The page table answers directly for pages already present;
+	 * the region list is only consulted on first touch.
+	 */
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	if (pte != NULL && (*pte & PTE_BUSY)) {
+		/* In transit; wait for it and look again. */
+		cv_wait(vm_cv, vm_lock);
+		return VM_AGAIN;
+	}
+	if (pte == NULL || *pte == 0) {
+		ar = as_findregion(as, faultaddress);
+		if (ar == NULL) {
+			return EFAULT;
+		}
+		if (pte == NULL) {
+			pte = pt_lookup(as->as_pt, faultaddress, true);
+			if (pte == NULL) {
+				return ENOMEM;
+			}
+		}
+		result = as_pagein(as, ar, faultaddress, pte);
+		if (result) {
+			return result;
+		}
+	}
+	else if (*pte & PTE_SWAPPED) {
+		result = as_swapin(as, pte);
+		if (result) {
+			return result;
+		}
+	}
+	else if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+
+	if (faulttype == VM_FAULT_READONLY) {
+		if ((*pte & PTE_WRITE) == 0) {
+			return EACCES;		// permission denied 
+		}
+		result = as_unshare(pte);
+		if (result) {
+			return result;
+		}
+	}
+
+	paddr = *pte & PTE_FRAME;
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/*
+	 * Shared frames stay read-only until written, and pinned. A
+	 * frame we hold alone is handed to the clock, marked used; if
+	 * it was shared, this also tells the coremap who owns it now.
+	 * It is only mapped writable once written, so that the first
+	 * write faults and the frame can be marked dirty.
+	 */
+	elo = paddr | TLBLO_VALID;
+	if (coremap_refcount(paddr) == 1) {
+		coremap_setowner(paddr, as, faultaddress);
+		if (*pte & PTE_WRITE) {
+			if (faulttype != VM_FAULT_READ) {
+				slot = coremap_setdirty(paddr);
+				if (slot != CM_NOSLOT) {
+					swap_free(slot);
+				}
+			}
+			if (coremap_isdirty(paddr)) {
+				elo |= TLBLO_DIRTY;
+			}
+		}
+	}
+
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	st = as_swtlb_slot(as, faultaddress);
+	st->st_vaddr = faultaddress;
+	st->st_elo = elo;
+	vm_tlbload(as, faultaddress, elo, faulttype == VM_FAULT_READONLY);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/* Read-only regions, shared and clean pages. */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	/*
+	 * A TLB miss on a recently used page is answered from the
+	 * software TLB without touching the page table or vm_lock.
+	 */
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		if (vm_swtlbload(as, faultaddress)) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			return 0;
+		}
+	}
 
+	lock_acquire(vm_lock);
+	do {
+		result = vm_pagefault(as, faulttype, faultaddress);
+	} while (result == VM_AGAIN);
+	lock_release(vm_lock);
+	return result;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+struct addrspace *
+as_create(void)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-				// kprintf("GPP pa %d\n", npages);
+	struct addrspace *as = kmem_cache_alloc(as_cache);
 
-	if (pa==0) {
-		return ENOMEM;
+	if (as==NULL) {
+		return NULL;
 	}
-	
-	return PADDR_TO_KVADDR(pa);
-}
-
-void 
-free_kpages(vaddr_t addr)
-{
-	/* nothing - leak the memory. */
-	#if OPT_A3
-
-	/****** reverse of getppages  *****/ 
-	
-	spinlock_acquire(&cm_lock);
-
-	paddr_t paddr = KVADDR_TO_PADDR(addr); 
-
-	int i =  (paddr - p_addr_low)/PAGE_SIZE;  // REVERSE GETPPAGES
-	// kprintf("freeing block of pages starting at  %x, index %d in cormap \n",addr, i);
 
-	// free the same number of pages as was allocated and update coremap to make those rames available
-	
-	// figure out indices later 
-	// int pgsSoFar = 0; 
-	
-	// i++;
-	// kprintf("%d %d\n", cm[i], cm[i+1]);
-	// kprintf("FREED page\n");
-	cm[i] = 0; 
-	// kprintf("FREED coremap[%d] \n", i);
-
-	i++;
-	while(i < core_size && cm[i]+1 == cm[i+1] ){
-		// kprintf("FREED coremap[%d] \n", i);
-
-		cm[i] = 0; 
-		i++;
-		// pgsSoFar++;
-	}
-	// kprintf("freed %d pages from coremap\n", pgsSoFar);
-	spinlock_release(&cm_lock);
-	
-	/****** reverse of getppages done   *****/ 
-
-	#else
-	(void)addr;
-	#endif
+	/* as_pt is constructed, and left empty by as_destroy. */
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	as->as_stack = NULL;
+	as->as_file = NULL;
+	as_swtlb_flush(as);
+	as->as_asid = 0;
+	as->as_asidgen = 0;	/* none yet; assigned on activation */
+	as->as_cpus = 0;
+	as->as_busy = 0;
+
+	lock_acquire(vm_lock);
+	as->as_prev = NULL;
+	as->as_next = as_all;
+	if (as_all != NULL) {
+		as_all->as_prev = as;
+	}
+	as_all = as;
+	lock_release(vm_lock);
+	return as;
 }
 
 void
-vm_tlbshootdown_all(void)
+as_destroy(struct addrspace *as)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	struct as_region *ar;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	lock_acquire(vm_lock);
+	as_waitidle(as);
+	pt_clear(as->as_pt);
+	if (as->as_prev != NULL) {
+		as->as_prev->as_next = as->as_next;
+	}
+	else {
+		as_all = as->as_next;
+	}
+	if (as->as_next != NULL) {
+		as->as_next->as_prev = as->as_prev;
+	}
+	lock_release(vm_lock);
+	while (as->as_regions != NULL) {
+		ar = as->as_regions;
+		as->as_regions = ar->ar_next;
+		kfree(ar);
+	}
+	if (as->as_file != NULL) {
+		vfs_close(as->as_file);
+	}
+	kmem_cache_free(as_cache, as);
 }
 
+#else /* !OPT_A3 */
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -264,9 +1289,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
-#if OPT_A3
-	bool is_code = false; 	//code seg or not 
-#endif 
 
 	faultaddress &= PAGE_FRAME;
 
@@ -275,11 +1297,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 		/* We always create pages read-write, so we can't get this */
-	#if OPT_A3
-		return EACCES;			// permission denied 
-	#else
 		panic("dumbvm: got VM_FAULT_READONLY\n");		
-	#endif
 
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
@@ -307,13 +1325,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	}
 
 	/* Assert that the address space has been set up properly. */
-	#if OPT_A3
-
-	// KASSERT(as->as_pbase1 != NULL);
-	// KASSERT(as->as_pbase2 != NULL);
-	// KASSERT(as->as_stackpbase != NULL);
-
-	#else 
 	KASSERT(as->as_pbase1 != 0);
 	KASSERT(as->as_pbase2 != 0);
 	KASSERT(as->as_stackpbase != 0);
@@ -322,7 +1333,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
-	#endif
 	KASSERT(as->as_vbase1 != 0);
 	KASSERT(as->as_npages1 != 0);
 	KASSERT(as->as_vbase2 != 0);
@@ -337,22 +1347,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-#if OPT_A3	
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1[0];		
-		is_code = true; 	// whether this is the code segment
-
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2[0];
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase[0];
-	}
-	else {
-		return EFAULT;
-	}
-#else
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 
@@ -366,7 +1360,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else {
 		return EFAULT;
 	}
-#endif
 	/* make sure it's page-aligned */
 	// kprintf("%x\n", paddr); 
 	// kprintf("%x\n", PAGE_FRAME); 	
@@ -376,6 +1369,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
@@ -383,11 +1377,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	#if OPT_A3
-		if(is_code && as->loadelf_done){
-			elo &= ~TLBLO_DIRTY;
-		}
-	#endif 
 
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
@@ -395,21 +1384,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return 0;
 	}
 
-#if OPT_A3
-	// allow full tlb to work 
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if(is_code && as->loadelf_done){
-		elo &= ~TLBLO_DIRTY;
-	} 
-	tlb_random(ehi, elo);
-	splx(spl);
-	return 0;
-#else
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
-#endif
 }
 
 struct addrspace *
@@ -423,16 +1400,9 @@ as_create(void)
 	}
 
 	
-#if OPT_A3
-	as->loadelf_done = false;
-	as->as_pbase1 = NULL;
-	as->as_pbase2 = NULL;
-	as->as_stackpbase = NULL;
-#else
 	as->as_pbase1 = 0;
 	as->as_pbase2 = 0;
 	as->as_stackpbase = 0;
-#endif
 as->as_vbase1 = 0;
 	as->as_npages1 = 0;
 	as->as_vbase2 = 0;
@@ -440,34 +1410,23 @@ as->as_vbase1 = 0;
 	return as;
 }
 
+
 void
 as_destroy(struct addrspace *as)
 {
-	#if OPT_A3
-	for(size_t i = 0; i < as->as_npages1; i++){
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase1[i]));
-	}
-	kfree(as->as_pbase1); 
-	for(size_t i = 0; i < as->as_npages2; i++){
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase2[i]));
-	}
-		kfree(as->as_pbase2); 
-
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; i++){
-		free_kpages(PADDR_TO_KVADDR(as->as_stackpbase[i]));
-	}
-		kfree(as->as_stackpbase); 
-
-	#endif
 	kfree(as);
 	// KASSERT(as == NULL);
 		// kprintf("freeing as\n");
 }
 
+#endif /* OPT_A3 */
+
 void
 as_activate(void)
 {
+#if !OPT_A3
 	int i, spl;
+#endif
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -478,6 +1437,9 @@ as_activate(void)
 		return;
 	}
 
+#if OPT_A3
+	as_setasid(as);
+#else
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -486,6 +1448,7 @@ as_activate(void)
 	}
 
 	splx(spl);
+#endif
 }
 
 void
@@ -494,6 +1457,252 @@ as_deactivate(void)
 	/* nothing */
 }
 
+#if OPT_A3
+/*
+ * Create a region and insert it in address order. Fails with EINVAL
+ * if it would overlap an existing one.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages, int perms,
+	     struct as_region **ret)
+{
+	struct as_region *ar, **p;
+	vaddr_t top;
+
+	KASSERT((base & PAGE_FRAME) == base);
+	top = base + npages * PAGE_SIZE;
+	if (top < base || top > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	for (p = &as->as_regions; *p != NULL; p = &(*p)->ar_next) {
+		if ((*p)->ar_base >= top) {
+			break;
+		}
+		if ((*p)->ar_base + (*p)->ar_npages * PAGE_SIZE > base) {
+			return EINVAL;
+		}
+	}
+
+	ar = kmalloc(sizeof(*ar));
+	if (ar == NULL) {
+		return ENOMEM;
+	}
+	ar->ar_base = base;
+	ar->ar_npages = npages;
+	ar->ar_perms = perms;
+	ar->ar_fvaddr = 0;
+	ar->ar_foffset = 0;
+	ar->ar_fsize = 0;
+	ar->ar_next = *p;
+	*p = ar;
+
+	if (ret != NULL) {
+		*ret = ar;
+	}
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	int perms;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	perms = (readable ? AR_READ : 0) | (writeable ? AR_WRITE : 0) |
+		(executable ? AR_EXEC : 0);
+
+	return as_addregion(as, vaddr, sz / PAGE_SIZE, perms, NULL);
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Nothing is allocated or zeroed up front; vm_fault fills
+	 * pages in as they are touched.
+	 */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct as_region *ar;
+	vaddr_t heapbase;
+
+	/* The heap starts empty, just past the last segment. */
+	heapbase = 0;
+	for (ar = as->as_regions; ar != NULL; ar = ar->ar_next) {
+		heapbase = ar->ar_base + ar->ar_npages * PAGE_SIZE;
+	}
+	KASSERT(as->as_heap == NULL);
+	as->as_brk = heapbase;
+	return as_addregion(as, heapbase, 0, AR_READ | AR_WRITE,
+			    &as->as_heap);
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	KASSERT(as->as_stack == NULL);
+	result = as_addregion(as, USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE,
+			      DUMBVM_STACKPAGES, AR_READ | AR_WRITE,
+			      &as->as_stack);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+int
+as_define_file(struct addrspace *as, struct vnode *v,
+	       vaddr_t vaddr, off_t offset, size_t filesize)
+{
+	struct as_region *ar;
+
+	for (ar = as->as_regions; ar != NULL; ar = ar->ar_next) {
+		if (vaddr >= ar->ar_base && vaddr + filesize <=
+		    ar->ar_base + ar->ar_npages * PAGE_SIZE) {
+			break;
+		}
+	}
+	if (ar == NULL) {
+		return ENOEXEC;
+	}
+	ar->ar_fvaddr = vaddr;
+	ar->ar_foffset = offset;
+	ar->ar_fsize = filesize;
+
+	/* Keep the executable open for as long as we may fault on it. */
+	if (as->as_file == NULL) {
+		VOP_INCOPEN(v);
+		VOP_INCREF(v);
+		as->as_file = v;
+	}
+	KASSERT(as->as_file == v);
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct as_region *heap;
+	vaddr_t brk, limit, oldtop, newtop;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return EINVAL;
+	}
+	brk = as->as_brk;
+	if (amount < 0 && (vaddr_t)-amount > brk - heap->ar_base) {
+		return EINVAL;
+	}
+
+	lock_acquire(vm_lock);
+
+	/* Stay a guard page clear of the next region, i.e. the stack. */
+	limit = heap->ar_next != NULL ?
+		heap->ar_next->ar_base - PAGE_SIZE : USERSPACETOP;
+	if (amount > 0 &&
+	    (brk + amount < brk || ROUNDUP(brk + amount, PAGE_SIZE) > limit)) {
+		lock_release(vm_lock);
+		return ENOMEM;
+	}
+
+	/* Growing only moves the end; pages come in on first touch. */
+	oldtop = heap->ar_base + heap->ar_npages * PAGE_SIZE;
+	newtop = ROUNDUP(brk + amount, PAGE_SIZE);
+	if (newtop < oldtop) {
+		/* Drop the pages given up, and their TLB entries. */
+		as_waitidle(as);
+		vm_unmap(as, newtop, (oldtop - newtop) / PAGE_SIZE);
+		pt_unmap(as->as_pt, newtop, oldtop);
+	}
+	heap->ar_npages = (newtop - heap->ar_base) / PAGE_SIZE;
+	as->as_brk = brk + amount;
+
+	lock_release(vm_lock);
+
+	*oldbrk = brk;
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct as_region *ar, *nar;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (ar = old->as_regions; ar != NULL; ar = ar->ar_next) {
+		result = as_addregion(new, ar->ar_base, ar->ar_npages,
+				      ar->ar_perms, &nar);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		nar->ar_fvaddr = ar->ar_fvaddr;
+		nar->ar_foffset = ar->ar_foffset;
+		nar->ar_fsize = ar->ar_fsize;
+		if (ar == old->as_heap) {
+			new->as_heap = nar;
+		}
+		if (ar == old->as_stack) {
+			new->as_stack = nar;
+		}
+	}
+
+	new->as_brk = old->as_brk;
+
+	if (old->as_file != NULL) {
+		VOP_INCOPEN(old->as_file);
+		VOP_INCREF(old->as_file);
+		new->as_file = old->as_file;
+	}
+
+	/* Pages the parent never touched stay untouched in the child. */
+	lock_acquire(vm_lock);
+	as_waitidle(old);
+	result = pt_share(new->as_pt, old->as_pt);
+
+	/*
+	 * The parent may still have writable TLB entries for pages
+	 * that are now shared, in its software TLB and in the TLB of
+	 * any cpu it has run on. Its read-only entries stay valid.
+	 */
+	vm_unmapwritable(old);
+	lock_release(vm_lock);
+
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
+
+#else /* !OPT_A3 */
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -520,14 +1729,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
 
-	#if OPT_A3
-		as->as_pbase1 = kmalloc(sizeof(paddr_t)* npages);
-			// kprintf("KM as->as_pbase1\n");
-
-		if(as->as_pbase1 == NULL){
-			return ENOMEM;
-		}
-	#endif
 
 		return 0;
 	}
@@ -536,14 +1737,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
 
-	#if OPT_A3
-		as->as_pbase2 = kmalloc(sizeof(paddr_t)* npages);
-					// kprintf("KM as->as_pbase2\n");
-
-		if(as->as_pbase2 == NULL){
-			return ENOMEM;
-		}
-	#endif
 
 		return 0;
 	}
@@ -556,59 +1749,10 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
 	// kprintf("as_prepare_load\n");
-#if OPT_A3
-	// KASSERT(as->as_pbase1 == NULL);  	//set by as_create()
-	// KASSERT(as->as_pbase2 == NULL); 	//set by as_create()
-	// KASSERT(as->as_stackpbase != NULL);
-	for(size_t i = 0; i < as->as_npages1; i++){
-		as->as_pbase1[i] = getppages(1);
-					// kprintf("GPP as_pbase1[i]\n");
-
-		if (as->as_pbase1 == 0) {		// possible to not have enough mem for getppages
-			return ENOMEM;
-		}
-		as_zero_region(as->as_pbase1[i], 1);
-	}
-
-	for(size_t i = 0; i < as->as_npages2; i++){
-		as->as_pbase2[i] = getppages(1);
-					// kprintf("GPP as_pbase2\n");
-
-		if (as->as_pbase2 == 0) {
-			return ENOMEM;
-		}
-		as_zero_region(as->as_pbase2[i], 1);	
-	}	
-
-	as->as_stackpbase = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-				// kprintf("KM as->as_stackpbase\n");
-
-	if(as->as_stackpbase == NULL){
-		return ENOMEM;
-	}
-	
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; i++){
-		as->as_stackpbase[i] = getppages(1);
-			// kprintf("GPP as->as_stackpbase[i]\n");
-
-		if (as->as_stackpbase == 0) {
-			return ENOMEM;
-		}
-		as_zero_region(as->as_stackpbase[i], 1);
-	} 
- 
-#else
 
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
@@ -638,7 +1782,6 @@ as_prepare_load(struct addrspace *as)
 	as_zero_region(as->as_pbase1, as->as_npages1);
 	as_zero_region(as->as_pbase2, as->as_npages2);
 	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
-#endif
 	return 0;
 }
 
@@ -661,6 +1804,7 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -677,51 +1821,16 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
-#if OPT_A3
-	new->as_pbase1 = kmalloc(sizeof(paddr_t) * old->as_npages1);
-	new->as_pbase2 = kmalloc(sizeof(paddr_t) * old->as_npages2);
-	new->as_stackpbase = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-			// kprintf("KM new->as_pbase1\n");
-			// kprintf("KM new->as_pbase2\n");
-			// kprintf("KM new->as_stackpbase\n");
-
-#endif
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
 
-#if OPT_A3
-
-	KASSERT(new->as_pbase1 != NULL);
-	KASSERT(new->as_pbase2 != NULL);
-	KASSERT(new->as_stackpbase != NULL);
-
-	for(size_t i = 0; i < old->as_npages1; i++){
-		memmove((void *)PADDR_TO_KVADDR(new->as_pbase1[i]),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1[i]),
-		PAGE_SIZE);
-	}
-
-	for(size_t i = 0; i < old->as_npages2; i++){
-		memmove((void *)PADDR_TO_KVADDR(new->as_pbase2[i]),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2[i]),
-		PAGE_SIZE);
-	}
-
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; i++){
-		memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase[i]),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase[i]),
-		PAGE_SIZE);
-	}
-	
-#else
 	KASSERT(new->as_pbase1 != 0);
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
 
-
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
@@ -733,7 +1842,8 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
-#endif
 	*ret = new;
 	return 0;
 }
+
+#endif /* OPT_A3 */
@@ -41,6 +41,7 @@
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
 #include "autoconf.h"
+#include "opt-A3.h"
 
 /*
  * CPU frequency used by the on-chip timer.
@@ -73,6 +74,25 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+#if OPT_A3
+/*
+ * Zero c0_count. System/161 also resets it to 0 each time it reaches
+ * c0_compare, so this restarts the current timer period.
+ */
+static
+void
+mips_timer_restart(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+#endif
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +136,28 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+#if OPT_A3
+/*
+ * Tickless idle. Stopping the on-chip timer just puts c0_compare as
+ * far off as it goes, a bit under three minutes at 25 MHz; if it
+ * does go off, mainbus_interrupt restarts the usual period and the
+ * idle loop stops it again.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_restart();
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_restart();
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+#endif
+
 /*
  * Start all secondary CPUs.
  */
@@ -47,6 +47,9 @@
 #define LT_REG_SPKR   20    /* Beep control */
 
 static bool havetimerclock;
+#if OPT_A3
+static struct ltimer_softc *timerclock_lt;
+#endif
 
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
@@ -88,16 +91,43 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
+#if OPT_A3
+		/*
+		 * One-shot; ltimer_timerclock_set starts it when a
+		 * timeout is pending.
+		 */
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		timerclock_lt = lt;
+#else
 		/* Wire it to go off once every 10 ms */
 		/* KMS: reduced this from 1s to 10ms */
 		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
 		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
 				   LT_GRANULARITY);
+#endif
 	}
 	
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Start the timer clock counting down USECS microseconds, replacing
+ * any countdown in progress. Does nothing before the timer is found;
+ * nothing can be waiting on it yet then.
+ */
+void
+ltimer_timerclock_set(uint32_t usecs)
+{
+	struct ltimer_softc *lt = timerclock_lt;
+
+	if (lt == NULL) {
+		return;
+	}
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+#endif
+
 /*
  * Interrupt handler.
  */
@@ -30,6 +30,8 @@
 #ifndef _LAMEBUS_LTIMER_H_
 #define _LAMEBUS_LTIMER_H_
 
+#include "opt-A3.h"
+
 /*
  * Hardware device data for LAMEbus timer device
  */
@@ -56,4 +58,9 @@ void ltimer_beep(/*struct ltimer_softc*/ void *devdata);   // for beep device
 void ltimer_gettime(/*struct ltimer_softc*/ void *devdata,
 		    time_t *secs, uint32_t *nsecs);       // for rtclock
 
+#if OPT_A3
+/* Called by the timeout code: call timerclock() once, USECS from now. */
+void ltimer_timerclock_set(uint32_t usecs);
+#endif
+
 #endif /* _LAMEBUS_LTIMER_H_ */
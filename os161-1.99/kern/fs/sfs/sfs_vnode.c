@@ -44,6 +44,10 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -53,6 +57,47 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 //
 // Simple stuff
 
+#if OPT_A3
+/*
+ * In-memory vnodes come from an object cache, which packs them
+ * several to a page instead of one per 1k kmalloc block. It is made
+ * the first time it's needed; like the rest of sfs, that's under the
+ * vfs big lock.
+ */
+static struct kmem_cache *sfs_vnode_cache;
+#endif
+
+/* Allocate and free the storage for an in-memory vnode. */
+static
+struct sfs_vnode *
+sfs_vnode_alloc(void)
+{
+#if OPT_A3
+	KASSERT(vfs_biglock_do_i_hold());
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+			sizeof(struct sfs_vnode), NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return NULL;
+		}
+	}
+	return kmem_cache_alloc(sfs_vnode_cache);
+#else
+	return kmalloc(sizeof(struct sfs_vnode));
+#endif
+}
+
+static
+void
+sfs_vnode_free(struct sfs_vnode *sv)
+{
+#if OPT_A3
+	kmem_cache_free(sfs_vnode_cache, sv);
+#else
+	kfree(sv);
+#endif
+}
+
 /* Zero out a disk block. */
 static
 int
@@ -953,7 +998,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_free(sv);
 
 	/* Done */
 	return 0;
@@ -1685,7 +1730,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = sfs_vnode_alloc();
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1744,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -1736,7 +1781,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -1747,7 +1792,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
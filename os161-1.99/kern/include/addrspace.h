@@ -38,8 +38,45 @@
 #include <vm.h>
 
 struct vnode;
+#if OPT_A3
+struct pagetable;
+#endif
 
 
+#if OPT_A3
+/*
+ * A region is a page-aligned range of the address space with one set
+ * of permissions. Part of it may be backed by the executable; the
+ * rest is zero-filled on first touch.
+ */
+struct as_region {
+    vaddr_t ar_base;          // first page
+    size_t ar_npages;         // length in pages
+    int ar_perms;             // AR_* below
+    vaddr_t ar_fvaddr;        // where the file image starts
+    off_t ar_foffset;         // its offset in as_file
+    size_t ar_fsize;          // and its length (0 if none)
+    struct as_region *ar_next;
+};
+
+/* Region permissions; same values as the ELF PF_* flags */
+#define AR_EXEC   1
+#define AR_WRITE  2
+#define AR_READ   4
+
+/*
+ * Software TLB: a direct-mapped cache of recent translations, in
+ * the form they are loaded into the MMU, indexed by virtual page
+ * number. An entry with st_elo 0 is empty.
+ */
+#define SWTLB_SIZE  64
+
+struct swtlb_entry {
+    vaddr_t st_vaddr;
+    uint32_t st_elo;
+};
+#endif
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -50,20 +87,29 @@ struct vnode;
 struct addrspace {
 
   #if OPT_A3
-    paddr_t * as_pbase1;      // page table for text
-    paddr_t * as_pbase2;      //page table for data
-    paddr_t * as_stackpbase;  // page table for stack
-    bool loadelf_done;        // added flag
+    struct as_region *as_regions;   // all regions, sorted by address
+    struct as_region *as_heap;      // heap, right after the last segment
+    vaddr_t as_brk;                 // end of the heap, as set by sbrk
+    struct as_region *as_stack;     // stack, grows down from USERSTACK
+    struct pagetable *as_pt;        // page table
+    struct vnode *as_file;          // executable backing the segments
+    struct swtlb_entry as_swtlb[SWTLB_SIZE];  // recent translations
+    unsigned as_asid;               // TLB address space ID
+    unsigned as_asidgen;            // generation as_asid belongs to
+    uint32_t as_cpus;               // cpus that ran it under as_asid
+    unsigned as_busy;               // pages in transit to or from disk
+    struct addrspace *as_prev;      // on the list of all address spaces
+    struct addrspace *as_next;
   #else 
     paddr_t as_pbase1;
     paddr_t as_pbase2;
     paddr_t as_stackpbase;
-  #endif 
   
     vaddr_t as_vbase1;
     size_t as_npages1;
     vaddr_t as_vbase2;
     size_t as_npages2;
+  #endif 
 };
 
 
@@ -101,6 +147,15 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_file - record that FILESIZE bytes at offset OFFSET of
+ *                executable V belong at VADDR. Pages are read in on
+ *                first touch rather than when the program is loaded;
+ *                the address space keeps V open until it is destroyed.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand back
+ *                the old end. Pages are allocated when first touched;
+ *                shrinking frees the pages given up.
  */
 
 struct addrspace *as_create(void);
@@ -117,6 +172,13 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 vaddr_t vaddr, off_t offset,
+                                 size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+#endif
 
 
 /*
@@ -31,6 +31,7 @@
 #define _CLOCK_H_
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 /*
  * Time-related definitions.
@@ -39,7 +40,8 @@
  * when the CPU is not idle, for scheduling.
  *
  * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timed operations. (This is a fairly simpleminded interface.) With
+ * A3 it is called only when a timeout (below) is due.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -83,5 +85,41 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+#if OPT_A3
+/*
+ * Timeouts: call a function at a given time. Times are nanoseconds
+ * as returned by clock_nsecs(), which counts from an arbitrary point
+ * and doesn't wrap; the timer device counts microseconds, so that's
+ * the real precision. The function is called on one cpu from the
+ * timer interrupt, with no locks held, and must not sleep. The timer
+ * device only interrupts when a timeout is due, and each cpu's
+ * hardclock is stopped while the cpu is idle.
+ *
+ *     clock_nsecs    - the current time.
+ *     timeout_init   - set up TO to call FUNC(ARG).
+ *     timeout_set    - (re)start TO to go off at time WHEN.
+ *     timeout_cancel - stop TO if it's pending. Returns true if it
+ *                      was; false if it had gone off already. If it
+ *                      is going off right now, waits for FUNC to
+ *                      return, so don't call it holding a spinlock
+ *                      that FUNC takes.
+ *
+ * struct timeout is owned by the caller and is not copied; it must
+ * stay put until it has gone off or been cancelled.
+ */
+struct timeout {
+	struct timeout *to_next;	/* pending list, soonest first */
+	uint64_t to_when;		/* time to go off at */
+	bool to_pending;
+	void (*to_func)(void *);
+	void *to_arg;
+};
+
+uint64_t clock_nsecs(void);
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_set(struct timeout *to, uint64_t when);
+bool timeout_cancel(struct timeout *to);
+#endif
+
 
 #endif /* _CLOCK_H_ */
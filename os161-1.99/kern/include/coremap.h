@@ -0,0 +1,173 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator (coremap).
+ *
+ * All physical memory left over after the kernel has been loaded is
+ * managed as an array of frames. Free frames are kept on buddy lists,
+ * one list per block order: a free block of order k is 2^k frames
+ * long and starts on a 2^k frame boundary (counted from the first
+ * managed frame). The list links live in the free frames themselves.
+ *
+ * Each frame also has a descriptor (struct cm_entry). The descriptor
+ * array is carved from the bottom of the managed memory at bootstrap.
+ * The first frame of a run or free block records the length. Freeing
+ * a run therefore never has to look at the frames after the first.
+ * The descriptor also has room for the owner, a refcount and flags,
+ * for use by the VM system.
+ *
+ * A single page comes straight off the order-0 list. A run of npages
+ * is cut from the smallest non-empty order that fits, the block is
+ * split on the way down, and the unused tail is handed back, so any
+ * allocation or free is O(log n) in the number of frames.
+ *
+ * In front of the buddy lists each cpu keeps a small cache of free
+ * single frames (struct pagecache, in struct cpu). Single-page
+ * allocations and frees are served from the local cache with only
+ * interrupts disabled; cm_lock is taken only to refill an empty cache
+ * or drain a full one, PAGECACHE_BATCH frames at a time. Frames in a
+ * cache are still marked allocated in the coremap.
+ *
+ * Functions:
+ *     coremap_bootstrap  - take over the memory reported by
+ *                          ram_getsize(). Called once from vm_bootstrap;
+ *                          ram_stealmem may not be used afterwards.
+ *     coremap_alloc      - allocate NPAGES physically contiguous frames.
+ *                          Returns 0 if no such run is free.
+ *     coremap_free       - drop a reference to a run returned by
+ *                          coremap_alloc, given the physical address of
+ *                          its first frame. The run is freed when the
+ *                          last reference goes.
+ *     coremap_share      - add a reference to a single frame, mapped at
+ *                          the user page VADDR, when it is shared
+ *                          copy-on-write.
+ *     coremap_refcount   - return the number of references to a frame.
+ *                          Only a holder of a reference may ask, and a
+ *                          result of 1 means the caller has the only one.
+ *     coremap_setowner   - record that the user page VADDR of AS is the
+ *                          only mapping of a frame, making it evictable,
+ *                          and mark it recently used.
+ *     coremap_pin        - make a frame unevictable, e.g. while it is
+ *                          written out. coremap_setowner undoes this.
+ *     coremap_evictable  - check that a frame is evictable and owned by
+ *                          the page VADDR of AS.
+ *     coremap_victim     - choose a frame to evict, returning it and its
+ *                          owner, or 0 if no frame is evictable. The
+ *                          owner may be NULL; see below. With CLEANONLY
+ *                          set, dirty frames are passed over.
+ *     coremap_setslot    - record that a frame holds the same data as
+ *                          swap slot SLOT (or CM_NOSLOT for none), and
+ *                          so is clean.
+ *     coremap_takeslot   - remove and return the slot a frame holds a
+ *                          copy of, or CM_NOSLOT. The caller takes over
+ *                          the slot.
+ *     coremap_isdirty    - check whether a frame was changed since it was
+ *                          paged in.
+ *     coremap_setdirty   - mark a frame changed. Any copy in swap is now
+ *                          stale; its slot is returned for the caller to
+ *                          free, or CM_NOSLOT.
+ *     coremap_nfree      - return the number of frames on the free lists.
+ *     coremap_setkmref   - record kmalloc's bookkeeping for a page it
+ *                          carves into blocks (NULL to clear it again).
+ *                          The page may be any page of a kernel run.
+ *                          Does nothing for frames that predate the
+ *                          coremap.
+ *     coremap_getkmref   - fetch it, in *REF (NULL if none). Returns
+ *                          false if the frame predates the coremap.
+ *     coremap_printstats - print the state of the free lists and the
+ *                          per-cpu cache hit/miss counters.
+ *
+ *     pagecache_init     - initialize a cpu's page cache. Called from
+ *                          cpu_create.
+ */
+
+struct addrspace;
+
+/*
+ * Per-frame descriptor, packed into 12 bytes; it costs 0.3% of memory.
+ *
+ * ce_npages is only meaningful in the first frame of an allocated
+ * run (CMF_ALLOC) or of a free block (CMF_FREE); it is 0 elsewhere.
+ * A user page (CMF_USER) is always a run of one frame, so there the
+ * same bits hold the page's virtual page number instead, as ce_vpn.
+ * ce_owner is the address space a user page belongs to, or kmalloc's
+ * record for a kernel page it carves up (CMF_KMALLOC). ce_vpn,
+ * ce_refcount, ce_slot, CMF_USER, CMF_PINNED, CMF_DIRTY and CMF_REF
+ * belong to the VM system and are reset when a run is allocated.
+ *
+ * A user page is clean, with CMF_DIRTY clear, until it is first
+ * written. If it was read in from swap, ce_slot keeps that copy, so
+ * evicting the page again needs no write; otherwise it can be paged
+ * in again from the executable or as zeros. The slot must be taken
+ * back before the frame's last reference is freed.
+ *
+ * Every frame starts out pinned. Only a single user page mapped by
+ * exactly one address space, as recorded by coremap_setowner, is
+ * unpinned; sharing or freeing the frame pins it again. When a shared
+ * frame is freed down to its last reference it is unpinned, but which
+ * address space holds that reference is not known here, so ce_owner
+ * stays NULL; ce_vpn is kept, since copy-on-write sharers all map
+ * the frame at the same address. The VM system must serialize these
+ * calls with eviction itself.
+ */
+struct cm_entry {
+	void *ce_owner;			/* see above, or NULL */
+	uint32_t ce_npages:20;		/* length of run or free block */
+	uint32_t ce_flags:12;		/* CMF_* below */
+	uint16_t ce_refcount;		/* references to this frame */
+	uint16_t ce_slot;		/* swap slot holding a copy, or
+					   CM_NOSLOT */
+};
+
+/* The same bits as ce_npages, in a user page */
+#define ce_vpn		ce_npages
+
+/* ce_slot of a frame with no copy in swap; see SWAP_MAXSLOTS */
+#define CM_NOSLOT	0xffff
+
+#define CMF_FREE	0x0001	/* first frame of a free block */
+#define CMF_ALLOC	0x0002	/* first frame of an allocated run */
+#define CMF_PINNED	0x0004	/* frame may not be evicted */
+#define CMF_DIRTY	0x0008	/* changed since last written out */
+#define CMF_REF		0x0010	/* used since the clock hand passed */
+#define CMF_KMALLOC	0x0020	/* kmalloc page carved into blocks */
+#define CMF_USER	0x0040	/* single frame holding a user page */
+
+/* Frames held by one cpu's cache, at most */
+#define PAGECACHE_SIZE   16
+/* Frames moved between a cache and the buddy lists at a time */
+#define PAGECACHE_BATCH  8
+
+struct pagecache {
+	unsigned pc_count;			/* frames in pc_frames */
+	paddr_t pc_frames[PAGECACHE_SIZE];	/* cached free frames */
+
+	/* Statistics; a miss is a trip to the buddy lists. */
+	unsigned pc_allochits;
+	unsigned pc_allocmisses;
+	unsigned pc_freehits;
+	unsigned pc_freemisses;
+};
+
+void    coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+void    coremap_free(paddr_t paddr);
+void    coremap_share(paddr_t paddr, vaddr_t vaddr);
+unsigned coremap_refcount(paddr_t paddr);
+void    coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void    coremap_pin(paddr_t paddr);
+bool    coremap_evictable(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_victim(struct addrspace **as, vaddr_t *vaddr, bool cleanonly);
+void    coremap_setslot(paddr_t paddr, unsigned slot);
+unsigned coremap_takeslot(paddr_t paddr);
+bool    coremap_isdirty(paddr_t paddr);
+unsigned coremap_setdirty(paddr_t paddr);
+unsigned coremap_nfree(void);
+void    coremap_setkmref(paddr_t paddr, void *ref);
+bool    coremap_getkmref(paddr_t paddr, void **ref);
+void    coremap_printstats(void);
+
+void    pagecache_init(struct pagecache *pc);
+
+#endif /* _COREMAP_H_ */
@@ -0,0 +1,59 @@
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+/*
+ * Per-cpu event counters.
+ *
+ * Each cpu has its own copy of every counter (c_counters in struct
+ * cpu) and only ever bumps its own, with interrupts off so it can't
+ * be preempted or moved halfway through. That needs no lock and no
+ * atomic instruction, and no cache line is shared between cpus, so
+ * counting costs next to nothing and can stay on all the time. A
+ * reader adds up all the cpus' copies without locking; the sum may
+ * miss increments still in progress, which is fine for statistics.
+ *
+ * The counters are a fixed set, numbered below. To add one, give it
+ * a number, move the ones after it up, and name it in counter.c.
+ *
+ * Functions:
+ *     counter_inc   - add one to counter N on this cpu.
+ *     _counter_inc  - the same, for callers that already have
+ *                     interrupts off (holding a spinlock, say).
+ *     counter_read  - the total of counter N over all cpus.
+ *     counter_reset - zero counters FIRST to FIRST+NUM-1 on every
+ *                     cpu. Increments racing with this may be lost.
+ *     counter_print - print the scheduler, kmalloc and system call
+ *                     counters that are not zero. (vmstats_print
+ *                     prints the VM ones.)
+ */
+
+/* uw-vmstats, in VMSTAT_* order; VMSTAT_COUNT of them */
+#define CNT_VMSTAT		0
+
+/* kmalloc magazines; a miss is a trip to the depot */
+#define CNT_KM_ALLOCHIT		10
+#define CNT_KM_ALLOCMISS	11
+#define CNT_KM_FREEHIT		12
+#define CNT_KM_FREEMISS		13
+
+/* Scheduler */
+#define CNT_SCHED_SWITCH	14	/* context switches */
+#define CNT_SCHED_EXPIRE	15	/* quanta used up */
+#define CNT_SCHED_IDLE		16	/* times a cpu went idle */
+#define CNT_SCHED_STEAL		17	/* threads taken from other cpus */
+#define CNT_SCHED_KICK		18	/* idle cpus woken to steal work */
+
+/* System calls, by call number; numbers out of range count as OTHER */
+#define CNT_SYSCALL		19
+#define CNT_NSYSCALLS		120	/* call numbers 0 to SYS_reboot */
+#define CNT_SYSCALL_OTHER	(CNT_SYSCALL + CNT_NSYSCALLS)
+
+#define CNT_COUNT		(CNT_SYSCALL_OTHER + 1)
+
+void counter_inc(unsigned n);
+void _counter_inc(unsigned n);
+unsigned counter_read(unsigned n);
+void counter_reset(unsigned first, unsigned num);
+void counter_print(void);
+
+#endif /* _COUNTER_H_ */
@@ -34,6 +34,15 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
+#if OPT_A3
+#include <coremap.h>
+#include <kmalloc.h>
+#include <counter.h>
+
+/* Scheduler priority levels (run queues per cpu) */
+#define SCHED_NPRIO	4
+#endif
 
 
 /*
@@ -60,13 +69,28 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+#if OPT_A3
+	struct pagecache c_pagecache;	/* Free single frames */
+	unsigned c_tlbused;		/* TLB slots filled since last flush */
+	unsigned c_tlbnext;		/* Next TLB slot to replace */
+	unsigned c_asidgen;		/* ASID generation of our TLB */
+	unsigned c_asid;		/* ASID loaded in EntryHi */
+	struct kmags c_kmags;		/* kmalloc magazines */
+	struct threadlist c_threadpool;	/* Dead threads kept for reuse */
+	unsigned c_counters[CNT_COUNT];	/* See counter.h; others read them */
+#endif
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+#if OPT_A3
+	struct threadlist c_runqueue[SCHED_NPRIO]; /* Run queues, by level */
+	unsigned c_runcount;		/* Threads on all of them */
+#else
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+#endif
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -109,6 +133,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+#if OPT_A3
+/*
+ * Number of cpus, and the cpu with a given software number, for code
+ * that reports per-cpu state.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned software_number);
+#endif
+
 /*
  * Return a string describing the CPU type.
  */
@@ -0,0 +1,43 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+/*
+ * Per-cpu magazines for kmalloc's small block sizes.
+ *
+ * For each of the subpage allocator's KM_NSIZES block sizes, each cpu
+ * keeps a magazine of up to KM_MAGSIZE free blocks (struct kmags, in
+ * struct cpu). Small kmallocs and kfrees are served from the local
+ * magazine with only interrupts disabled. An empty magazine is
+ * refilled, and a full one unloaded, KM_BATCH blocks at a time, from
+ * and to a shared depot; only when the depot has nothing to give, or
+ * holds too much, are blocks taken from or handed back to the subpage
+ * allocator under its lock. Blocks in magazines and in the depot are
+ * still allocated as far as the subpage allocator is concerned.
+ *
+ * Functions:
+ *     kmalloc_bootstrap - start using the magazines. Called from
+ *                         vm_bootstrap: kfree finds a block's size
+ *                         through the coremap.
+ *     kmags_init        - initialize a cpu's magazines. Called from
+ *                         cpu_create.
+ *     kmags_drain       - give the blocks in the depot and in this
+ *                         cpu's magazines back to the subpage
+ *                         allocator, which frees any pages left with
+ *                         no blocks in use. Returns the number of
+ *                         blocks given back.
+ */
+
+#define KM_NSIZES	8	/* block sizes, 16 to 2048 */
+#define KM_MAGSIZE	16	/* blocks per magazine, at most */
+#define KM_BATCH	8	/* blocks moved to or from the depot at once */
+
+struct kmags {
+	unsigned km_count[KM_NSIZES];		/* blocks in each magazine */
+	void *km_objs[KM_NSIZES][KM_MAGSIZE];	/* the blocks */
+};
+
+void kmalloc_bootstrap(void);
+void kmags_init(struct kmags *km);
+unsigned kmags_drain(void);
+
+#endif /* _KMALLOC_H_ */
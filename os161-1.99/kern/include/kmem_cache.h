@@ -0,0 +1,43 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one type. Objects are carved out
+ * of slabs of whole pages, as many pages as it takes to waste no more
+ * than an eighth of the slab, so objects that would land in one of
+ * kmalloc's power-of-two block sizes with room to spare pack tightly.
+ *
+ * An object is constructed (by the cache's CTOR) the first time it
+ * is handed out, and stays constructed while it sits free in the
+ * cache: a caller returning an object must leave it in the state the
+ * constructor put it in. The destructor runs only when the slab the
+ * object lives in is given back to the VM system. So locks, cvs,
+ * arrays and the like that an object owns are made once, not once
+ * per use.
+ *
+ * Functions:
+ *     kmem_cache_create  - create a cache of SIZE-byte objects. CTOR
+ *                          returns 0 or an error; CTOR and DTOR may
+ *                          each be NULL. NAME is not copied. Returns
+ *                          NULL if out of memory.
+ *     kmem_cache_alloc   - get a constructed object, or NULL if out
+ *                          of memory.
+ *     kmem_cache_free    - return an object, constructed, to its cache.
+ *     kmem_cache_destroy - destroy a cache. All its objects must have
+ *                          been freed.
+ *     kmem_cache_printstats - print usage for all caches.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_destroy(struct kmem_cache *kc);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -0,0 +1,37 @@
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+/*
+ * kmalloc allocation-site profiler, compiled in with "options kmprof".
+ *
+ * kmalloc records the address it was called from and the size of
+ * each live block in a fixed side table, and kfree drops the record
+ * again. Per call site we keep the live blocks and bytes and the
+ * number of allocations ever made. Sites are printed as addresses;
+ * look them up with os161-addr2line on the kernel image. (Blocks
+ * from kstrdup all show up at kstrdup.)
+ *
+ * A mark snapshots every site, so that what has happened since (a
+ * test run, say) can be looked at on its own: allocation rates are
+ * measured from the mark, and kmprof_print(KMPROF_DIFF, ...) lists
+ * the sites whose live bytes grew since it, which is where to look
+ * for leaks.
+ *
+ * Functions:
+ *     kmprof_alloc - record a block of SIZE bytes at PTR, allocated
+ *                    from CALLER. Called by kmalloc.
+ *     kmprof_free  - forget the block at PTR. Called by kfree.
+ *     kmprof_mark  - take a snapshot.
+ *     kmprof_print - print the top N sites, by the given measure.
+ */
+
+#define KMPROF_LIVE	0	/* live bytes */
+#define KMPROF_RATE	1	/* allocations since the mark */
+#define KMPROF_DIFF	2	/* growth in live bytes since the mark */
+
+void kmprof_alloc(void *ptr, size_t size, vaddr_t caller);
+void kmprof_free(void *ptr);
+void kmprof_mark(void);
+void kmprof_print(int how, unsigned n);
+
+#endif /* _KMPROF_H_ */
@@ -0,0 +1,58 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics, compiled in with "options lockstat".
+ *
+ * Spinlocks, sleep locks and wait channels all report to a fixed
+ * table of records. Per record we count acquisitions and how many of
+ * them found the lock taken, and add up the time spent waiting for it
+ * and holding it, keeping the longest of each. Sleep locks are keyed
+ * by lk_name, so all the locks of one kind share a record. Spinlocks
+ * have no names and are keyed by address; look the static ones up
+ * with os161-nm. For a wait channel every wchan_sleep counts as a
+ * contended acquisition, and the wait is the time asleep.
+ *
+ * Times come from the real-time clock (the ltimer, on System/161),
+ * so nothing is recorded until that has attached. The table has one
+ * lock of its own that every lock operation goes through, so expect
+ * things to run rather slower with lockstat compiled in.
+ *
+ * Functions:
+ *     lockstat_bootstrap   - start recording. Call once, after the
+ *                            clock attaches and before the other cpus
+ *                            start, so no lock is held across it.
+ *     lockstat_now         - the time in nanoseconds, or 0 if not
+ *                            recording yet.
+ *     lockstat_record      - account one acquisition of a lock of type
+ *                            KIND, found by KEY (the struct spinlock *
+ *                            for spinlocks, otherwise the name), with
+ *                            its wait and hold times. Called on release.
+ *     lockstat_sleep_start - note the start of a wchan_sleep on the
+ *                            channel called NAME.
+ *     lockstat_sleep_done  - and its end.
+ *     lockstat_print       - print the N records with the most
+ *                            contended acquisitions and clear the table.
+ */
+
+#define LOCKSTAT_SPIN	1	/* spinlock */
+#define LOCKSTAT_LOCK	2	/* sleep lock */
+#define LOCKSTAT_WCHAN	3	/* wait channel */
+
+/* Longest name kept, with the terminating null; longer ones are cut */
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat_sleep {
+	char ls_name[LOCKSTAT_NAMELEN];	/* copied; the wchan may go away */
+	uint64_t ls_start;
+};
+
+void lockstat_bootstrap(void);
+uint64_t lockstat_now(void);
+void lockstat_record(int kind, const void *key, bool contended,
+		     uint64_t wait, uint64_t hold);
+void lockstat_sleep_start(struct lockstat_sleep *ls, const char *name);
+void lockstat_sleep_done(struct lockstat_sleep *ls);
+void lockstat_print(unsigned n);
+
+#endif /* _LOCKSTAT_H_ */
@@ -30,6 +30,8 @@
 #ifndef _MAINBUS_H_
 #define _MAINBUS_H_
 
+#include "opt-A3.h"
+
 /*
  * Abstract system bus interface.
  */
@@ -55,6 +57,16 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+#if OPT_A3
+/*
+ * Stop and restart hardclock on the current CPU, so an idle CPU
+ * doesn't take timer interrupts. A stopped hardclock may still tick
+ * now and then.
+ */
+void mainbus_hardclock_stop(void);
+void mainbus_hardclock_start(void);
+#endif
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
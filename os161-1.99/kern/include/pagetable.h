@@ -0,0 +1,64 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for a user address space.
+ *
+ * The top 10 bits of a virtual address index the directory and the
+ * next 10 index a second-level table of 1024 entries, which is
+ * exactly one page. Second-level tables are only allocated for the
+ * parts of the address space that have been touched. Translating an
+ * address is therefore two array lookups regardless of how many
+ * regions the address space has.
+ *
+ * A page table entry holds the physical frame in its upper bits and
+ * PTE_* flags in the low bits. An entry of 0 means no page is present
+ * yet. Each present entry holds one coremap reference on its frame;
+ * a swap slot the frame keeps a copy in (see coremap.h) is freed with
+ * the last reference.
+ * A page that has been swapped out has PTE_SWAPPED set and its swap
+ * slot in place of the frame; the entry holds a reference to the slot.
+ * While a page is being read in or written out, with vm_lock dropped,
+ * the VM system sets PTE_BUSY in its entry. None of the functions
+ * below may be called on a table with busy entries.
+ *
+ * Functions:
+ *     pt_create  - create an empty page table. Returns NULL if out
+ *                  of memory.
+ *     pt_clear   - empty a page table, dropping the reference held by
+ *                  each present entry and freeing its swap slots.
+ *     pt_destroy - pt_clear, then free the page table.
+ *     pt_lookup  - return a pointer to the entry for VADDR. If its
+ *                  second-level table doesn't exist, returns NULL,
+ *                  or with CREATE set allocates the table (NULL if
+ *                  out of memory).
+ *     pt_unmap   - remove the pages from START up to END, dropping
+ *                  their frames and swap slots as pt_destroy does.
+ *                  The caller takes care of the TLB.
+ *     pt_share   - make DST map every page SRC maps, to the same
+ *                  frames and swap slots, taking a reference on
+ *                  each. Used for copy-on-write fork. Returns an
+ *                  error on failure, leaving DST partly filled in but
+ *                  consistent.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	PAGE_FRAME	/* physical frame */
+#define PTE_WRITE	0x00000001	/* region allows writes */
+#define PTE_SWAPPED	0x00000002	/* page is in swap */
+#define PTE_BUSY	0x00000004	/* page is in transit */
+
+#define PTE_SLOT(pte)	((pte) >> 12)			/* swap slot */
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+struct pagetable;
+
+struct pagetable *pt_create(void);
+void              pt_clear(struct pagetable *pt);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+void              pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end);
+int               pt_share(struct pagetable *dst, struct pagetable *src);
+
+#endif /* _PAGETABLE_H_ */
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -57,12 +58,21 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	uint64_t lk_acqtime;		/* For lockstat: when acquired, */
+	uint64_t lk_waittime;		/* how long that took, */
+	bool lk_contended;		/* and whether it was taken. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, false }
+#else
 #define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
 
 /*
  * Spinlock functions.
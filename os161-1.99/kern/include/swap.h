@@ -0,0 +1,45 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to page-sized slots on the
+ * vnode named by SWAP_PATH: by default the raw second disk, though
+ * anything that can be opened when vm_bootstrap runs will do. Each
+ * slot has a reference count, so that a page swapped out before a
+ * fork can be shared by parent and child, like a frame, instead of
+ * copied. Slots are handed out in runs, so a cluster of pages can go
+ * out in a single write.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device. If it can't be opened
+ *                      the system runs without swap.
+ *     swap_alloc     - allocate up to *NSLOTS consecutive slots.
+ *                      Returns the first in *SLOT and how many were
+ *                      found in *NSLOTS, or ENOSPC if none are free.
+ *     swap_free      - drop a reference to a slot, freeing it when
+ *                      the last one goes.
+ *     swap_share     - add a reference to a slot.
+ *     swap_read      - read a slot into the frame at PADDR.
+ *     swap_write     - write NPAGES frames to the consecutive slots
+ *                      starting at SLOT, in one I/O. NPAGES is at
+ *                      most SWAP_CLUSTER.
+ */
+
+#define SWAP_PATH	"lhd1raw:"
+
+/* Most pages written out together */
+#define SWAP_CLUSTER	8
+
+/* Most slots used; the coremap keeps slot numbers in 16 bits. */
+#define SWAP_MAXSLOTS	0xffff
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot, unsigned *nslots);
+void swap_free(unsigned slot);
+void swap_share(unsigned slot);
+int  swap_read(unsigned slot, paddr_t paddr);
+int  swap_write(unsigned slot, const paddr_t *paddrs, unsigned npages);
+
+#endif /* _SWAP_H_ */
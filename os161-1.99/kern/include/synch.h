@@ -36,6 +36,8 @@
 
 
 #include <spinlock.h>
+#include "opt-A3.h"
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -62,6 +64,14 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+#if OPT_A3
+/*
+ * P_timed: P, but give up at time WHEN (see clock_nsecs in <clock.h>).
+ * Returns 0 with the count decremented, or ETIMEDOUT.
+ */
+int P_timed(struct semaphore *, uint64_t when);
+#endif
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -76,9 +86,20 @@ struct lock {
         char *lk_name;
 	
 				volatile bool lk_held;
+#if OPT_A3
+				struct thread *volatile lk_owner;
+				unsigned lk_waiters;	/* threads asleep on lk_wchan */
+				bool lk_handoff;	/* held for a woken waiter */
+#else
 				struct thread * lk_owner;
+#endif
 				struct spinlock lk_spinlock;
 				struct wchan * lk_wchan;
+#if OPT_LOCKSTAT
+				uint64_t lk_acqtime;	/* for lockstat; see spinlock.h */
+				uint64_t lk_waittime;
+				bool lk_contended;
+#endif
 
         // add what you need here
         // (don't forget to mark things volatile as needed)
@@ -97,6 +118,12 @@ void lock_acquire(struct lock *);
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * With A3 the lock is adaptive: lock_acquire spins for a while as
+ * long as the holder is running on another CPU, since it will likely
+ * let go soon, and sleeps otherwise. lock_release hands the lock
+ * straight to a sleeping thread if there is one, so the thread it
+ * wakes always gets it.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
@@ -142,5 +169,59 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+#if OPT_A3
+/*
+ * cv_timedwait: cv_wait, but stop waiting at time WHEN (see
+ * clock_nsecs in <clock.h>). The lock is reacquired either way.
+ * Returns 0 if signalled, or ETIMEDOUT. As with cv_wait, recheck the
+ * condition either way.
+ */
+int cv_timedwait(struct cv *cv, struct lock *lock, uint64_t when);
+#endif
+
+
+#if OPT_A3
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers, or one writer, may hold it at once. Writers
+ * are preferred: once a writer is waiting, arriving readers wait too,
+ * so a stream of readers can't starve writers. When a writer lets go,
+ * all the readers waiting at that point are let in together as a
+ * batch, ahead of any other waiting writers, so writers can't starve
+ * readers either; the next writer goes when that batch drains. Either
+ * way the lock is handed straight to the threads woken.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;	/* protects all the following */
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers wait here */
+	unsigned rw_readers;		/* readers holding it */
+	bool rw_writing;		/* a writer holds it */
+	struct thread *rw_writer;	/* ...which, once it's running */
+	unsigned rw_rwaiting;		/* readers asleep */
+	unsigned rw_wwaiting;		/* writers asleep */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Give up a write hold. Only the thread
+ *                           holding it may do this.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+#endif
 
 #endif /* _SYNCH_H_ */
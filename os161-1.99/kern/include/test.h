@@ -61,6 +61,11 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 
+/* These are only actually available if OPT_A3 is set. */
+int rwtest(int, char **);
+int rwspeedtest(int, char **);
+int timedtest(int, char **);
+
 #ifdef UW
 /* Another thread and synchronization test */
 int uwlocktest1(int, char **);
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-A3.h"
 
 struct cpu;
 
@@ -83,6 +84,12 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+#if OPT_A3
+	unsigned t_prio;		/* Run queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used of this quantum */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when last run */
+	struct wchan *t_wchan;		/* Wait channel last slept on */
+#endif
 
 	/*
 	 * Interrupt state fields.
@@ -162,11 +169,23 @@ void thread_yield(void);
  */
 void schedule(void);
 
+#if OPT_A3
+/*
+ * Charge the current thread for a hardclock. Returns true if it
+ * should yield: its quantum is used up, or a thread of higher
+ * priority is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+#endif
+
+#if !OPT_A3
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * timer interrupt. (With A3, idle CPUs steal work instead; see
+ * thread.c.)
  */
 void thread_consider_migration(void);
+#endif
 
 
 #endif /* _THREAD_H_ */
@@ -48,6 +48,12 @@
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Shutdown function; prints VM statistics */
+void vm_shutdown(void);
+
+/* Print TLB flush and ASID allocation counts */
+void vm_printtlbstats(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
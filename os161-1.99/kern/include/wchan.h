@@ -35,6 +35,8 @@
  */
 
 
+#include "opt-A3.h"
+
 struct wchan; /* Opaque */
 
 /*
@@ -71,6 +73,14 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+#if OPT_A3
+/*
+ * Like wchan_sleep, but give up at time WHEN (see clock_nsecs in
+ * <clock.h>). Returns 0 if awakened, or ETIMEDOUT if WHEN came first.
+ */
+int wchan_sleep_timeout(struct wchan *wc, uint64_t when);
+#endif
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
@@ -81,5 +91,15 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+#if OPT_A3
+/*
+ * Move the first thread (or with ALL, every thread) sleeping on FROM
+ * to TO, where it sleeps on until woken from there. The threads can
+ * tell by their t_wchan. Returns how many were moved. Neither channel
+ * should be locked; FROM's lock is taken before TO's.
+ */
+unsigned wchan_move(struct wchan *from, struct wchan *to, bool all);
+#endif
+
 
 #endif /* _WCHAN_H_ */
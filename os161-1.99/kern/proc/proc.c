@@ -51,6 +51,11 @@
 #include <synch.h>
 #include <kern/fcntl.h>  
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kern/errno.h>
+#include <kmem_cache.h>
+#endif
 #if OPT_A2
 //	#include <mips/trapframe.h>
 #endif
@@ -80,6 +85,61 @@ struct semaphore *no_proc_sem;
 
 #endif  // UW
 
+#if OPT_A3
+/*
+ * Procs come from an object cache. A free proc keeps its thread
+ * array, child array, lock and cv, so fork and exit don't make and
+ * destroy them every time; proc_destroy leaves them as the
+ * constructor made them.
+ */
+static struct kmem_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+
+	proc->child_procs = array_create();
+	if (proc->child_procs == NULL) {
+		goto fail;
+	}
+	proc->lk_child_procs = lock_create("child_procs_lk");
+	if (proc->lk_child_procs == NULL) {
+		goto fail_array;
+	}
+	proc->cv_exiting = cv_create("child cv_exiting");
+	if (proc->cv_exiting == NULL) {
+		goto fail_lock;
+	}
+	return 0;
+
+ fail_lock:
+	lock_destroy(proc->lk_child_procs);
+ fail_array:
+	array_destroy(proc->child_procs);
+ fail:
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+	return ENOMEM;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	cv_destroy(proc->cv_exiting);
+	lock_destroy(proc->lk_child_procs);
+	array_destroy(proc->child_procs);
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+}
+#endif /* OPT_A3 */
 
 /*
  * Create a proc structure.
@@ -98,18 +158,32 @@ proc_create(const char *name)
 
 	struct proc *proc;
 
+#if OPT_A3
+	proc = kmem_cache_alloc(proc_cache);
+#else
 	proc = kmalloc(sizeof(*proc));
+#endif
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(proc_cache, proc);
+#else
 		// kfree(proc);
+#endif
 		return NULL;
 	}
 
+#if OPT_A3
+	/* p_threads, p_lock and the child machinery are constructed. */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(array_num(proc->child_procs) == 0);
+#else
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -142,6 +216,7 @@ proc_create(const char *name)
 	// initialize other proc fields 
 	proc->parent = NULL;
 
+#if !OPT_A3
 	proc->child_procs = array_create(); 
 	array_init(proc->child_procs);
 
@@ -159,6 +234,7 @@ proc_create(const char *name)
 		kfree(proc); 
 		return NULL;
 	}
+#endif
 
 	proc->exit_code = 0; 			// default ok?
 	// proc->tf = NULL;				// possible overwriting? 
@@ -230,8 +306,10 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+#if !OPT_A3
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
+#endif
 
 	#if OPT_A2
 			// kprint("acquired lock %d in PD 1 \n", proc->pid);
@@ -274,6 +352,11 @@ proc_destroy(struct proc *proc)
 
 		// KASSERT((int)array_num(proc->child_procs) == 0);
 
+#if OPT_A3
+		/* Back to the constructed state; the cache keeps them. */
+		KASSERT(array_num(proc->child_procs) == 0);
+		lock_release(proc->lk_child_procs);
+#else
 		array_destroy(proc->child_procs);		//???
 		// //// kprint("after destroying array\n");
 		cv_destroy(proc->cv_exiting);
@@ -282,6 +365,7 @@ proc_destroy(struct proc *proc)
 		lock_release(proc->lk_child_procs);
 
 		lock_destroy(proc->lk_child_procs);
+#endif
 		// kprint("proc_destroy %d complete\n", proc->pid);
 
 	#endif
@@ -289,7 +373,11 @@ proc_destroy(struct proc *proc)
 
 	kfree(proc->p_name);
 
+#if OPT_A3
+	kmem_cache_free(proc_cache, proc);
+#else
 	kfree(proc);
+#endif
 
 #ifdef UW
 	/* decrement the process count */
@@ -329,6 +417,13 @@ proc_bootstrap(void)
 		}
 		
 	#endif
+#if OPT_A3
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				 proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
+#endif
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
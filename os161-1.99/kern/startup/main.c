@@ -50,6 +50,11 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-lockstat.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 
 /*
@@ -117,6 +122,10 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+#if OPT_LOCKSTAT
+	/* The clock is attached now, and the other cpus aren't running. */
+	lockstat_bootstrap();
+#endif
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
@@ -153,6 +162,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+	vm_shutdown();
+#endif
+
 	splhigh();
 }
 
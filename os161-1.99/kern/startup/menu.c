@@ -46,6 +46,20 @@
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+#include "opt-lockstat.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
+#if OPT_A3
+#include <coremap.h>
+#include <vm.h>
+#include <counter.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -418,6 +432,112 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_KMPROF
+/*
+ * Command for the allocation-site profiler:
+ *    kmp [live|rate|diff] [N]   show the top N (default 10) sites
+ *    kmp mark                   take a snapshot for rate and diff
+ */
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	const char *what = nargs > 1 ? args[1] : "live";
+	unsigned n = nargs > 2 ? (unsigned)atoi(args[2]) : 10;
+
+	if (nargs > 3) {
+		kprintf("Usage: kmp [live|rate|diff|mark] [N]\n");
+		return EINVAL;
+	}
+
+	if (!strcmp(what, "mark")) {
+		kmprof_mark();
+	}
+	else if (!strcmp(what, "live")) {
+		kmprof_print(KMPROF_LIVE, n);
+	}
+	else if (!strcmp(what, "rate")) {
+		kmprof_print(KMPROF_RATE, n);
+	}
+	else if (!strcmp(what, "diff")) {
+		kmprof_print(KMPROF_DIFF, n);
+	}
+	else {
+		kprintf("Usage: kmp [live|rate|diff|mark] [N]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+#endif
+
+#if OPT_LOCKSTAT
+/*
+ * Command for lock contention statistics:
+ *    lks [N]   show the N (default 10) most contended locks and
+ *              start counting afresh
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: lks [N]\n");
+		return EINVAL;
+	}
+
+	lockstat_print(nargs > 1 ? (unsigned)atoi(args[1]) : 10);
+	return 0;
+}
+#endif
+
+#if OPT_A3
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printtlbstats();
+
+	return 0;
+}
+
+/*
+ * Command for the per-cpu counters:
+ *    cnt         print them
+ *    cnt reset   zero them all
+ */
+static
+int
+cmd_counters(int nargs, char **args)
+{
+	if (nargs == 1) {
+		counter_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		counter_reset(0, CNT_COUNT);
+	}
+	else {
+		kprintf("Usage: cnt [reset]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -488,6 +608,11 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+#if OPT_A3
+	"[sy4] RW lock test                  ",
+	"[sy5] RW lock read throughput       ",
+	"[sy6] Timed wait test               ",
+#endif
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -528,6 +653,17 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_KMPROF
+	"[kmp] kmalloc allocation sites      ",
+#endif
+#if OPT_LOCKSTAT
+	"[lks] Lock contention stats         ",
+#endif
+#if OPT_A3
+	"[cm] Coremap stats                  ",
+	"[tlb] TLB/ASID stats                ",
+	"[cnt] Per-cpu counters              ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -585,6 +721,17 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_KMPROF
+	{ "kmp",        cmd_kmprof },
+#endif
+#if OPT_LOCKSTAT
+	{ "lks",        cmd_lockstat },
+#endif
+#if OPT_A3
+	{ "cm",         cmd_coremapstats },
+	{ "tlb",        cmd_tlbstats },
+	{ "cnt",        cmd_counters },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -602,6 +749,11 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+#if OPT_A3
+	{ "sy4",	rwtest },
+	{ "sy5",	rwspeedtest },
+	{ "sy6",	timedtest },
+#endif
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -81,9 +81,11 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_A3
 	struct iovec iov;
 	struct uio u;
 	int result;
+#endif
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
@@ -93,6 +95,19 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if OPT_A3
+	/*
+	 * Nothing is read now; the VM system pages the segment in
+	 * from the file as it is touched. Since uiomove won't see
+	 * the addresses, check for kernel space here.
+	 */
+	(void)is_executable;
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		return ENOEXEC;
+	}
+	return as_define_file(as, v, vaddr, offset, filesize);
+#else
+
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -143,6 +158,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -302,9 +318,5 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	*entrypoint = eh.e_entry;
-	#if OPT_A3
-	as->loadelf_done = true;
-	as_activate();
-	#endif
 	return 0;
 }
@@ -16,6 +16,7 @@
  #include <kern/fcntl.h>
 #endif
 #include "opt-A2.h"
+#include "opt-A3.h"
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -422,3 +423,18 @@ int sys_execv (const char * progname, char ** args, int *retval){
 }
 
 #endif
+
+#if OPT_A3
+/* handler for sbrk() system call */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_sbrk(as, amount, retval);
+}
+#endif
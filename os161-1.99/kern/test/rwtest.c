@@ -0,0 +1,240 @@
+/*
+ * Reader-writer lock tests.
+ *
+ * sy4 checks that readers and writers exclude each other properly.
+ * sy5 measures read throughput with 1, 2, ... up to one thread per
+ * cpu, all reading at once; with a working rwlock it should go up
+ * with the number of threads until the cpus run out.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NRWLOOPS	200
+#define NRWTHREADS	32
+#define NRWREADS	2000	/* per thread, for sy5 */
+#define RWDELAY		100	/* loop iterations spent holding the lock */
+
+static struct rwlock *testrw;
+static struct semaphore *rwdonesem;
+static struct semaphore *rwstartsem;
+
+static volatile unsigned long rwval1;
+static volatile unsigned long rwval2;
+
+/* Who's inside, and failures seen; protected by rwcountlock. */
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters, rwfailures;
+
+static
+void
+rwinit(void)
+{
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	if (rwdonesem == NULL) {
+		rwdonesem = sem_create("rwdonesem", 0);
+		if (rwdonesem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+	if (rwstartsem == NULL) {
+		rwstartsem = sem_create("rwstartsem", 0);
+		if (rwstartsem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+rwdelay(void)
+{
+	volatile int i;
+
+	for (i=0; i<RWDELAY; i++);
+}
+
+/*
+ * Note who's inside. WRITER is true for a writer. Checks that nobody
+ * is inside who shouldn't be.
+ */
+static
+void
+rwenter(unsigned long num, bool writer)
+{
+	spinlock_acquire(&rwcountlock);
+	if (rwwriters > 0 || (writer && rwreaders > 0)) {
+		kprintf("thread %lu: %s in with %u readers, %u writers\n",
+			num, writer ? "writer" : "reader",
+			rwreaders, rwwriters);
+		rwfailures++;
+	}
+	if (writer) {
+		rwwriters++;
+	}
+	else {
+		rwreaders++;
+	}
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwleave(bool writer)
+{
+	spinlock_acquire(&rwcountlock);
+	if (writer) {
+		rwwriters--;
+	}
+	else {
+		rwreaders--;
+	}
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	bool writer;
+	unsigned long v;
+	int i;
+
+	(void)junk;
+
+	/* One thread in four writes. */
+	writer = (num % 4 == 0);
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			rwenter(num, true);
+			rwval1 = num;
+			rwdelay();
+			rwval2 = num * num;
+			rwleave(true);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwenter(num, false);
+			v = rwval1;
+			rwdelay();
+			if (rwval1 != v || rwval2 != v * v) {
+				kprintf("thread %lu: saw a write in "
+					"progress\n", num);
+				spinlock_acquire(&rwcountlock);
+				rwfailures++;
+				spinlock_release(&rwcountlock);
+			}
+			rwleave(false);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(rwdonesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinit();
+	kprintf("Starting rwlock test...\n");
+
+	rwval1 = rwval2 = 0;
+	rwfailures = 0;
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	if (rwfailures > 0) {
+		kprintf("rwlock test failed: %u errors\n", rwfailures);
+	}
+	kprintf("rwlock test done.\n");
+	return 0;
+}
+
+static
+void
+rwreadthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	P(rwstartsem);
+	for (i=0; i<NRWREADS; i++) {
+		rwlock_acquire_read(testrw);
+		rwdelay();
+		rwlock_release_read(testrw);
+	}
+	V(rwdonesem);
+}
+
+int
+rwspeedtest(int nargs, char **args)
+{
+	unsigned n, i, ms, numcpus;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinit();
+	numcpus = cpu_count();
+	kprintf("rwlock read throughput, %u cpus, %u reads per thread\n",
+		numcpus, NRWREADS);
+
+	for (n=1; n<=numcpus; n++) {
+		for (i=0; i<n; i++) {
+			result = thread_fork("rwspeed", NULL, rwreadthread,
+					     NULL, i);
+			if (result) {
+				panic("rwspeedtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<n; i++) {
+			V(rwstartsem);
+		}
+		for (i=0; i<n; i++) {
+			P(rwdonesem);
+		}
+		gettime(&secs2, &nsecs2);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+		ms = secs2 * 1000 + nsecs2 / 1000000;
+		kprintf("  %2u threads: %u ms, %u reads/sec\n", n, ms,
+			ms > 0 ? n * NRWREADS * 1000 / ms : 0);
+	}
+
+	kprintf("rwlock throughput test done.\n");
+	return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * Timed wait tests.
+ *
+ * sy6 checks P_timed and cv_timedwait: that a wait on nothing times
+ * out, and not early; that a wakeup before the deadline is seen as
+ * one, with the lock held; that a wakeup racing the timeout is
+ * either consumed once or left for the next waiter, never both; and
+ * that a deadline already past gives up at once.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define TW_WAIT		100000000ULL	/* 100 ms, for waits that time out */
+#define TW_LONG		2000000000ULL	/* 2 s, for waits that shouldn't */
+#define TW_SHORT	10000000ULL	/* 10 ms, for checks afterwards */
+#define TW_PROMPT	10000000ULL	/* 10 ms, "at once" */
+#define TW_RACES	50		/* wakeups timed against the timeout */
+
+static struct semaphore *twsem;
+static struct semaphore *twdonesem;
+static struct lock *twlock;
+static struct cv *twcv;
+
+/* Protected by twlock */
+static volatile bool twflag;
+
+/* Deadline for the racing thread; set before it is forked. */
+static uint64_t twwhen;
+
+static unsigned twfailures;
+
+static
+void
+twinit(void)
+{
+	if (twsem == NULL) {
+		twsem = sem_create("twsem", 0);
+		if (twsem == NULL) {
+			panic("timedtest: sem_create failed\n");
+		}
+	}
+	if (twdonesem == NULL) {
+		twdonesem = sem_create("twdonesem", 0);
+		if (twdonesem == NULL) {
+			panic("timedtest: sem_create failed\n");
+		}
+	}
+	if (twlock == NULL) {
+		twlock = lock_create("twlock");
+		if (twlock == NULL) {
+			panic("timedtest: lock_create failed\n");
+		}
+	}
+	if (twcv == NULL) {
+		twcv = cv_create("twcv");
+		if (twcv == NULL) {
+			panic("timedtest: cv_create failed\n");
+		}
+	}
+}
+
+static
+void
+twcheck(bool ok, const char *what)
+{
+	if (!ok) {
+		kprintf("timedtest: %s\n", what);
+		twfailures++;
+	}
+}
+
+static
+void
+twfork(void (*func)(void *, unsigned long), unsigned long num)
+{
+	int result;
+
+	result = thread_fork("timedtest", NULL, func, NULL, num);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Signal twcv as soon as the main thread is waiting on it.
+ */
+static
+void
+twsignalthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(twlock);
+	twflag = true;
+	cv_signal(twcv, twlock);
+	lock_release(twlock);
+	V(twdonesem);
+}
+
+/*
+ * Wake the main thread at about twwhen, a little before or after its
+ * timeout goes off. Odd NUMs signal twcv, holding the lock on every
+ * other one so both the morphing and the plain wakeup get raced;
+ * even ones V twsem.
+ */
+static
+void
+twracethread(void *junk, unsigned long num)
+{
+	uint64_t when;
+
+	(void)junk;
+
+	/* Up to 40 us either side of the deadline. */
+	when = twwhen + (num / 2 % 5) * 20000 - 40000;
+	while (clock_nsecs() < when) {
+		/* spin */
+	}
+
+	if (num % 2 == 0) {
+		V(twsem);
+	}
+	else if (num % 4 == 1) {
+		lock_acquire(twlock);
+		cv_signal(twcv, twlock);
+		lock_release(twlock);
+	}
+	else {
+		cv_signal(twcv, twlock);
+	}
+	V(twdonesem);
+}
+
+/*
+ * A P_timed on an empty semaphore times out, and not before its
+ * deadline.
+ */
+static
+void
+twsemtimeout(void)
+{
+	uint64_t when;
+	int result;
+
+	when = clock_nsecs() + TW_WAIT;
+	result = P_timed(twsem, when);
+	twcheck(result == ETIMEDOUT, "P_timed on nothing didn't time out");
+	twcheck(clock_nsecs() >= when, "P_timed timed out early");
+}
+
+/*
+ * A cv_timedwait signalled well before its deadline returns 0, with
+ * the lock held.
+ */
+static
+void
+twcvsignal(void)
+{
+	uint64_t when;
+	int result;
+
+	when = clock_nsecs() + TW_LONG;
+	lock_acquire(twlock);
+	twflag = false;
+	/* It can't signal before we wait: it needs the lock first. */
+	twfork(twsignalthread, 0);
+	result = 0;
+	while (!twflag && result == 0) {
+		result = cv_timedwait(twcv, twlock, when);
+	}
+	twcheck(result == 0, "signalled cv_timedwait timed out");
+	twcheck(twflag, "cv_timedwait returned 0 without a signal");
+	twcheck(lock_do_i_hold(twlock), "cv_timedwait lost the lock");
+	lock_release(twlock);
+	P(twdonesem);
+}
+
+/*
+ * Race wakeups against the timeout. A semaphore count must be used
+ * exactly once, by the timed wait or by the next P; a cv signal that
+ * loses the race is lost, and mustn't wake a later waiter.
+ */
+static
+void
+twraces(void)
+{
+	unsigned i;
+	int result;
+	uint64_t now;
+
+	for (i=0; i<TW_RACES; i++) {
+		twwhen = clock_nsecs() + TW_SHORT;
+		if (i % 2 == 0) {
+			twfork(twracethread, i);
+			result = P_timed(twsem, twwhen);
+			P(twdonesem);
+			if (result == ETIMEDOUT) {
+				/* The V came too late; it's still there. */
+				result = P_timed(twsem, clock_nsecs());
+				twcheck(result == 0, "late V was lost");
+			}
+			else {
+				twcheck(result == 0, "P_timed failed");
+			}
+			result = P_timed(twsem, clock_nsecs() + TW_SHORT);
+			twcheck(result == ETIMEDOUT, "one V was used twice");
+		}
+		else {
+			lock_acquire(twlock);
+			twfork(twracethread, i);
+			result = cv_timedwait(twcv, twlock, twwhen);
+			twcheck(result == 0 || result == ETIMEDOUT,
+				"cv_timedwait failed");
+			twcheck(lock_do_i_hold(twlock),
+				"cv_timedwait lost the lock");
+			lock_release(twlock);
+			P(twdonesem);
+
+			/* Nobody signals now; a wakeup would be stale. */
+			lock_acquire(twlock);
+			now = clock_nsecs();
+			result = cv_timedwait(twcv, twlock, now + TW_SHORT);
+			twcheck(result == ETIMEDOUT,
+				"later cv_timedwait woken by an old signal");
+			twcheck(clock_nsecs() >= now + TW_SHORT,
+				"later cv_timedwait timed out early");
+			lock_release(twlock);
+		}
+	}
+}
+
+/*
+ * A deadline already past times out at once, without sleeping.
+ */
+static
+void
+twpast(void)
+{
+	uint64_t start;
+	int result;
+
+	start = clock_nsecs();
+	result = P_timed(twsem, start - 1);
+	twcheck(result == ETIMEDOUT, "P_timed in the past didn't time out");
+	twcheck(clock_nsecs() - start < TW_PROMPT,
+		"P_timed in the past slept");
+
+	lock_acquire(twlock);
+	start = clock_nsecs();
+	result = cv_timedwait(twcv, twlock, start - 1);
+	twcheck(result == ETIMEDOUT,
+		"cv_timedwait in the past didn't time out");
+	twcheck(clock_nsecs() - start < TW_PROMPT,
+		"cv_timedwait in the past slept");
+	twcheck(lock_do_i_hold(twlock), "cv_timedwait lost the lock");
+	lock_release(twlock);
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	twinit();
+	kprintf("Starting timed wait test...\n");
+
+	twfailures = 0;
+	twsemtimeout();
+	twcvsignal();
+	twraces();
+	twpast();
+
+	if (twfailures > 0) {
+		kprintf("timed wait test failed: %u errors\n", twfailures);
+	}
+	kprintf("timed wait test done.\n");
+	return 0;
+}
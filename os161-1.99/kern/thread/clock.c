@@ -30,11 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
+#include "opt-A3.h"
 
 /*
  * Time handling.
@@ -66,12 +68,55 @@ static struct wchan *minibolt;
 /* 
  * number of minibolts per second
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
 
+#if OPT_A3
+/*
+ * Pending timeouts, soonest first, and the one timerclock() is
+ * running right now. The timer device is programmed for the first
+ * one only, so no timer interrupts happen while nothing is pending.
+ *
+ * A sorted list rather than a wheel or heap: there are only ever a
+ * few timeouts pending, and this way the next deadline is always at
+ * hand.
+ */
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+static struct timeout *timeouts;
+static struct timeout *timeout_firing;
+
+/*
+ * Threads in clocksleep and clocknap sleep on lbolt and minibolt
+ * until their own deadline; each channel has one timeout, set for the
+ * soonest deadline of anyone sleeping on it.
+ */
+static struct timeout lbolt_timeout;
+static struct timeout minibolt_timeout;
+
+/*
+ * Longest the timer device is set for at once. A timeout further off
+ * than this just costs an extra interrupt on the way; this keeps the
+ * arithmetic in 32 bits.
+ */
+#define TIMEOUT_MAXNSECS	1000000000U
+#else
 /*
  * minibolt countdown
  */
 static int minicount;
+#endif
+
+#if OPT_A3
+/*
+ * Wake up everything on a wait channel. Timeout function for lbolt
+ * and minibolt.
+ */
+static
+void
+clock_wakeall(void *wc)
+{
+	wchan_wakeall(wc);
+}
+#endif
 
 /*
  * Setup.
@@ -87,11 +132,199 @@ hardclock_bootstrap(void)
 	if (minibolt == NULL) {
 		panic("Couldn't create minibolt\n");
 	}
+#if OPT_A3
+	timeout_init(&lbolt_timeout, clock_wakeall, lbolt);
+	timeout_init(&minibolt_timeout, clock_wakeall, minibolt);
+#else
 	minicount = MINI_PER_SECOND;
 	/* we assume MINI_PER_SECOND > 0 */
 	KASSERT(minicount > 0);
+#endif
+}
+
+#if OPT_A3
+uint64_t
+clock_nsecs(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)(uint32_t)secs * 1000000000U + nsecs;
+}
+
+/*
+ * Program the timer for the first pending timeout, if any. Call with
+ * timeout_lock held.
+ */
+static
+void
+timeout_program(uint64_t now)
+{
+	uint32_t nsecs;
+
+	if (timeouts == NULL) {
+		return;
+	}
+	if (timeouts->to_when <= now) {
+		nsecs = 0;
+	}
+	else if (timeouts->to_when - now > TIMEOUT_MAXNSECS) {
+		nsecs = TIMEOUT_MAXNSECS;
+	}
+	else {
+		nsecs = timeouts->to_when - now;
+	}
+	/* The timer counts whole microseconds; round up, and not 0. */
+	ltimer_timerclock_set(nsecs / 1000 + 1);
+}
+
+/*
+ * Take TO off the pending list, if it's on it. Call with timeout_lock
+ * held.
+ */
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	struct timeout **p;
+
+	if (!to->to_pending) {
+		return;
+	}
+	for (p = &timeouts; *p != to; p = &(*p)->to_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = to->to_next;
+	to->to_next = NULL;
+	to->to_pending = false;
+}
+
+/*
+ * Put TO on the pending list to go off at tick WHEN, and reprogram
+ * the timer if it's now first. Call with timeout_lock held.
+ */
+static
+void
+timeout_insert(struct timeout *to, uint64_t when, uint64_t now)
+{
+	struct timeout **p;
+
+	KASSERT(!to->to_pending);
+	to->to_when = when;
+	for (p = &timeouts; *p != NULL; p = &(*p)->to_next) {
+		if (when < (*p)->to_when) {
+			break;
+		}
+	}
+	to->to_next = *p;
+	*p = to;
+	to->to_pending = true;
+	if (timeouts == to) {
+		timeout_program(now);
+	}
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_when = 0;
+	to->to_pending = false;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+void
+timeout_set(struct timeout *to, uint64_t when)
+{
+	uint64_t now;
+
+	now = clock_nsecs();
+	spinlock_acquire(&timeout_lock);
+	timeout_unlink(to);
+	timeout_insert(to, when, now);
+	spinlock_release(&timeout_lock);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	bool wasset;
+
+	spinlock_acquire(&timeout_lock);
+	wasset = to->to_pending;
+	timeout_unlink(to);
+	/* If it's going off right now, wait for it to finish. */
+	while (timeout_firing == to) {
+		spinlock_release(&timeout_lock);
+		spinlock_acquire(&timeout_lock);
+	}
+	spinlock_release(&timeout_lock);
+	return wasset;
+}
+
+/*
+ * Sleep on WC, which is lbolt or minibolt, until time WHEN. TO is the
+ * channel's timeout; set it for WHEN unless it's already set sooner.
+ *
+ * The channel is locked while the timeout is set, and the timeout
+ * locks it to wake it, so the wakeup can't slip in between setting
+ * the timeout and going to sleep.
+ */
+static
+void
+clock_sleepuntil(struct wchan *wc, struct timeout *to, uint64_t when)
+{
+	uint64_t now;
+
+	for (;;) {
+		wchan_lock(wc);
+		now = clock_nsecs();
+		if (now >= when) {
+			wchan_unlock(wc);
+			break;
+		}
+		spinlock_acquire(&timeout_lock);
+		if (!to->to_pending || when < to->to_when) {
+			timeout_unlink(to);
+			timeout_insert(to, when, now);
+		}
+		spinlock_release(&timeout_lock);
+		wchan_sleep(wc);
+	}
 }
 
+/*
+ * This is called, on one processor, by the timer code when the timer
+ * set by timeout_program goes off. Timeout functions are called
+ * without timeout_lock held, so they can lock what they like and set
+ * timeouts of their own.
+ */
+void
+timerclock(void)
+{
+	struct timeout *to;
+	uint64_t now;
+
+	now = clock_nsecs();
+	spinlock_acquire(&timeout_lock);
+	while ((to = timeouts) != NULL && to->to_when <= now) {
+		timeouts = to->to_next;
+		to->to_next = NULL;
+		to->to_pending = false;
+		timeout_firing = to;
+		spinlock_release(&timeout_lock);
+
+		to->to_func(to->to_arg);
+
+		spinlock_acquire(&timeout_lock);
+		timeout_firing = NULL;
+	}
+	timeout_program(now);
+	spinlock_release(&timeout_lock);
+}
+#else
 /*
  * This is called once every every LT_GRANULARITY usec, on one processor,
  * by the timer code.
@@ -107,6 +340,7 @@ timerclock(void)
 	  wchan_wakeall(lbolt);
 	}
 }
+#endif /* OPT_A3 */
 
 /*
  * This is called HZ times a second (on each processor) by the timer
@@ -123,10 +357,21 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
+#if OPT_A3
+	/* No push migration; idle cpus steal work instead. */
+#else
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
+#endif
+#if OPT_A3
+	/* Preempt at the end of the quantum, or for a better thread. */
+	if (thread_tick()) {
+		thread_yield();
+	}
+#else
 	thread_yield();
+#endif
 }
 
 /*
@@ -135,11 +380,18 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
+#if OPT_A3
+  if (num_secs > 0) {
+    clock_sleepuntil(lbolt, &lbolt_timeout,
+		     clock_nsecs() + (uint64_t)(uint32_t)num_secs * 1000000000U);
+  }
+#else
   while (num_secs > 0) {
     wchan_lock(lbolt);
     wchan_sleep(lbolt);
     num_secs--;
   }
+#endif
 }
 
 /*
@@ -149,9 +401,17 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
+#if OPT_A3
+  if (num_ticks > 0) {
+    clock_sleepuntil(minibolt, &minibolt_timeout,
+		     clock_nsecs() +
+		     (uint64_t)(uint32_t)num_ticks * (LT_GRANULARITY * 1000));
+  }
+#else
   while (num_ticks > 0) {
     wchan_lock(minibolt);
     wchan_sleep(minibolt);
     num_ticks--;
   }
+#endif
 }
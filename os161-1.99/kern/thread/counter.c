@@ -0,0 +1,107 @@
+/*
+ * Per-cpu event counters. See counter.h for the overview.
+ */
+
+#include <types.h>
+#include <kern/syscall.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <uw-vmstats.h>
+#include <counter.h>
+
+/* Names for counter_print, from CNT_KM_ALLOCHIT to CNT_SCHED_KICK */
+static const char *const counter_names[] = {
+	"kmalloc magazine hits",
+	"kmalloc magazine misses",
+	"kfree magazine hits",
+	"kfree magazine misses",
+	"context switches",
+	"quanta used up",
+	"times idle",
+	"threads stolen",
+	"idle cpus kicked",
+};
+
+void
+counter_inc(unsigned n)
+{
+	int spl;
+
+	KASSERT(n < CNT_COUNT);
+
+	/* Stay on this cpu, and let no interrupt in between. */
+	spl = splhigh();
+	curcpu->c_counters[n]++;
+	splx(spl);
+}
+
+void
+_counter_inc(unsigned n)
+{
+	KASSERT(n < CNT_COUNT);
+	KASSERT(curthread->t_curspl > 0);
+
+	curcpu->c_counters[n]++;
+}
+
+unsigned
+counter_read(unsigned n)
+{
+	unsigned i, total;
+
+	KASSERT(n < CNT_COUNT);
+
+	total = 0;
+	for (i=0; i<cpu_count(); i++) {
+		total += cpu_get(i)->c_counters[n];
+	}
+	return total;
+}
+
+void
+counter_reset(unsigned first, unsigned num)
+{
+	struct cpu *c;
+	unsigned i, j;
+
+	KASSERT(first + num <= CNT_COUNT);
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		for (j=first; j<first+num; j++) {
+			c->c_counters[j] = 0;
+		}
+	}
+}
+
+void
+counter_print(void)
+{
+	unsigned i, v;
+
+	COMPILE_ASSERT(CNT_VMSTAT + VMSTAT_COUNT == CNT_KM_ALLOCHIT);
+	COMPILE_ASSERT(sizeof(counter_names) / sizeof(counter_names[0]) ==
+		       CNT_SYSCALL - CNT_KM_ALLOCHIT);
+	COMPILE_ASSERT(SYS_reboot < CNT_NSYSCALLS);
+
+	kprintf("Counters, %u cpus:\n", cpu_count());
+	for (i=CNT_KM_ALLOCHIT; i<CNT_SYSCALL; i++) {
+		v = counter_read(i);
+		if (v > 0) {
+			kprintf("  %-24s %10u\n",
+				counter_names[i - CNT_KM_ALLOCHIT], v);
+		}
+	}
+	for (i=0; i<CNT_NSYSCALLS; i++) {
+		v = counter_read(CNT_SYSCALL + i);
+		if (v > 0) {
+			kprintf("  syscall %-16u %10u\n", i, v);
+		}
+	}
+	v = counter_read(CNT_SYSCALL_OTHER);
+	if (v > 0) {
+		kprintf("  %-24s %10u\n", "bad syscall numbers", v);
+	}
+}
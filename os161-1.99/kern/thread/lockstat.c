@@ -0,0 +1,293 @@
+/*
+ * Lock contention statistics. See lockstat.h for the overview.
+ *
+ * The records live in an open-addressed hash table of fixed size, so
+ * recording never allocates memory. Nothing is ever removed except by
+ * clearing the whole table, so a lookup can stop at the first empty
+ * slot.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_NRECS		512	/* records; a power of 2 */
+#define LOCKSTAT_MAXPRINT	32	/* most lockstat_print will show */
+
+/* Where locks go once the table is full */
+#define LOCKSTAT_OTHER	0
+
+/* lr_kind of an unused slot */
+#define LOCKSTAT_NONE	0
+
+struct lockstat_rec {
+	int lr_kind;			/* LOCKSTAT_* */
+	const void *lr_addr;		/* spinlocks */
+	char lr_name[LOCKSTAT_NAMELEN];	/* everything else */
+	unsigned lr_acquires;
+	unsigned lr_contended;
+	uint64_t lr_waittotal;		/* nanoseconds */
+	uint64_t lr_waitmax;
+	uint64_t lr_holdtotal;
+	uint64_t lr_holdmax;
+};
+
+/*
+ * lockstat_lock protects the table. It's a bare lock word rather than
+ * a struct spinlock, since a spinlock would report to us itself.
+ */
+static volatile spinlock_data_t lockstat_lock = SPINLOCK_DATA_INITIALIZER;
+static struct lockstat_rec lockstat_recs[LOCKSTAT_NRECS];
+static unsigned lockstat_nrecs;		/* slots in use in lockstat_recs */
+
+/* Set once at boot; read without the lock. */
+static bool lockstat_on;
+
+/* lockstat_print's copy of the top records; only one print at a time. */
+static struct lockstat_rec lockstat_top[LOCKSTAT_MAXPRINT];
+
+static
+int
+lockstat_enter(void)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_get(&lockstat_lock) != 0 ||
+	       spinlock_data_testandset(&lockstat_lock) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+lockstat_exit(int spl)
+{
+	spinlock_data_set(&lockstat_lock, 0);
+	splx(spl);
+}
+
+/*
+ * Copy NAME into BUF, cutting it short if need be.
+ */
+static
+void
+lockstat_copyname(char *buf, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		buf[i] = name[i];
+	}
+	buf[i] = 0;
+}
+
+static
+unsigned
+lockstat_hash(int kind, const void *addr, const char *name)
+{
+	unsigned h;
+
+	if (kind == LOCKSTAT_SPIN) {
+		/* Fibonacci hashing; spinlocks are word aligned. */
+		return ((vaddr_t)addr >> 2) * 2654435761U >> 12;
+	}
+	h = kind;
+	while (*name != 0) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+/*
+ * Find or make the record for a lock. For spinlocks ADDR is the lock
+ * and NAME is ignored; otherwise it's the other way around. Call with
+ * lockstat_lock held.
+ */
+static
+struct lockstat_rec *
+lockstat_find(int kind, const void *addr, const char *name)
+{
+	struct lockstat_rec *lr;
+	unsigned i, n;
+
+	i = lockstat_hash(kind, addr, name) % LOCKSTAT_NRECS;
+	for (n = 0; n < LOCKSTAT_NRECS; n++, i = (i + 1) % LOCKSTAT_NRECS) {
+		if (i == LOCKSTAT_OTHER) {
+			continue;
+		}
+		lr = &lockstat_recs[i];
+		if (lr->lr_kind == LOCKSTAT_NONE) {
+			/* Keep the table at most 3/4 full so probes stay short. */
+			if (lockstat_nrecs >= LOCKSTAT_NRECS / 4 * 3) {
+				break;
+			}
+			lr->lr_kind = kind;
+			if (kind == LOCKSTAT_SPIN) {
+				lr->lr_addr = addr;
+			}
+			else {
+				strcpy(lr->lr_name, name);
+			}
+			lockstat_nrecs++;
+			return lr;
+		}
+		if (lr->lr_kind != kind) {
+			continue;
+		}
+		if (kind == LOCKSTAT_SPIN ? lr->lr_addr == addr :
+		    !strcmp(lr->lr_name, name)) {
+			return lr;
+		}
+	}
+	return &lockstat_recs[LOCKSTAT_OTHER];
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_on = true;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_on) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)(uint32_t)secs * 1000000000U + nsecs;
+}
+
+void
+lockstat_record(int kind, const void *key, bool contended,
+		uint64_t wait, uint64_t hold)
+{
+	struct lockstat_rec *lr;
+	char name[LOCKSTAT_NAMELEN];
+	int spl;
+
+	KASSERT(kind == LOCKSTAT_SPIN || kind == LOCKSTAT_LOCK ||
+		kind == LOCKSTAT_WCHAN);
+
+	if (!lockstat_on) {
+		return;
+	}
+	if (kind == LOCKSTAT_SPIN) {
+		name[0] = 0;
+	}
+	else {
+		lockstat_copyname(name, key);
+	}
+
+	spl = lockstat_enter();
+	lr = lockstat_find(kind, key, name);
+	lr->lr_acquires++;
+	if (contended) {
+		lr->lr_contended++;
+		lr->lr_waittotal += wait;
+		if (wait > lr->lr_waitmax) {
+			lr->lr_waitmax = wait;
+		}
+	}
+	lr->lr_holdtotal += hold;
+	if (hold > lr->lr_holdmax) {
+		lr->lr_holdmax = hold;
+	}
+	lockstat_exit(spl);
+}
+
+void
+lockstat_sleep_start(struct lockstat_sleep *ls, const char *name)
+{
+	ls->ls_start = lockstat_now();
+	if (ls->ls_start != 0) {
+		lockstat_copyname(ls->ls_name, name);
+	}
+}
+
+void
+lockstat_sleep_done(struct lockstat_sleep *ls)
+{
+	if (ls->ls_start != 0) {
+		lockstat_record(LOCKSTAT_WCHAN, ls->ls_name, true,
+				lockstat_now() - ls->ls_start, 0);
+	}
+}
+
+void
+lockstat_print(unsigned n)
+{
+	static const char *const kinds[] = { "", "spin", "lock", "wchan" };
+	struct lockstat_rec *lr;
+	unsigned i, j, pick, nrecs, acquires, contended;
+	int spl;
+
+	if (n > LOCKSTAT_MAXPRINT) {
+		n = LOCKSTAT_MAXPRINT;
+	}
+
+	/*
+	 * kprintf takes locks, which would come back to us, so copy
+	 * the top records out and clear the table before printing.
+	 * Selection; the table is small and N smaller.
+	 */
+	spl = lockstat_enter();
+	nrecs = lockstat_nrecs;
+	acquires = contended = 0;
+	for (i=0; i<LOCKSTAT_NRECS; i++) {
+		acquires += lockstat_recs[i].lr_acquires;
+		contended += lockstat_recs[i].lr_contended;
+	}
+	for (j=0; j<n; j++) {
+		pick = LOCKSTAT_NRECS;
+		for (i=0; i<LOCKSTAT_NRECS; i++) {
+			lr = &lockstat_recs[i];
+			if (lr->lr_contended > 0 && (pick == LOCKSTAT_NRECS ||
+			    lr->lr_contended >
+			    lockstat_recs[pick].lr_contended)) {
+				pick = i;
+			}
+		}
+		if (pick == LOCKSTAT_NRECS) {
+			break;
+		}
+		lockstat_top[j] = lockstat_recs[pick];
+		/* Nothing else reads it before the table is cleared. */
+		lockstat_recs[pick].lr_contended = 0;
+	}
+	bzero(lockstat_recs, sizeof(lockstat_recs));
+	lockstat_nrecs = 0;
+	lockstat_exit(spl);
+
+	kprintf("lockstat: %u locks, %u acquisitions, %u contended\n",
+		nrecs, acquires, contended);
+	kprintf("  type  lock                    acquires contended"
+		"   wait us    max us   hold us    max us\n");
+	n = j;
+	for (j=0; j<n; j++) {
+		lr = &lockstat_top[j];
+		if (lr->lr_kind == LOCKSTAT_NONE) {
+			kprintf("  %-5s %-23s", "", "(other)");
+		}
+		else if (lr->lr_kind == LOCKSTAT_SPIN) {
+			kprintf("  %-5s 0x%08lx             ", kinds[lr->lr_kind],
+				(unsigned long)lr->lr_addr);
+		}
+		else {
+			kprintf("  %-5s %-23s", kinds[lr->lr_kind],
+				lr->lr_name);
+		}
+		kprintf(" %8u %9u %9llu %9llu %9llu %9llu\n",
+			lr->lr_acquires, lr->lr_contended,
+			lr->lr_waittotal / 1000, lr->lr_waitmax / 1000,
+			lr->lr_holdtotal / 1000, lr->lr_holdmax / 1000);
+	}
+}
@@ -36,6 +36,10 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include "opt-lockstat.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 /*
  * Spinlocks.
@@ -50,6 +54,11 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_acqtime = 0;
+	lk->lk_waittime = 0;
+	lk->lk_contended = false;
+#endif
 }
 
 /*
@@ -73,6 +82,10 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKSTAT
+	bool contended;
+	uint64_t start;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +100,15 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKSTAT
+	/*
+	 * Only read the clock if we'll have to wait. (Losing a race for
+	 * the lock right after this check counts as uncontended.)
+	 */
+	contended = spinlock_data_get(&lk->lk_lock) != 0;
+	start = contended ? lockstat_now() : 0;
+#endif
+
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -108,6 +130,11 @@ spinlock_acquire(struct spinlock *lk)
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	lk->lk_acqtime = lockstat_now();
+	lk->lk_waittime = contended ? lk->lk_acqtime - start : 0;
+	lk->lk_contended = contended;
+#endif
 }
 
 /*
@@ -116,13 +143,31 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+#if OPT_LOCKSTAT
+	uint64_t acqtime, waittime;
+	bool contended;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	/* Take these while we still hold the lock. */
+	acqtime = lk->lk_acqtime;
+	waittime = lk->lk_waittime;
+	contended = lk->lk_contended;
+#endif
+
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
+#if OPT_LOCKSTAT
+	if (acqtime != 0) {
+		lockstat_record(LOCKSTAT_SPIN, lk, contended, waittime,
+				lockstat_now() - acqtime);
+	}
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -39,6 +39,16 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include "opt-A3.h"
+#include "opt-lockstat.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
+#if OPT_A3
+#include <kern/errno.h>
+#include <cpu.h>
+#include <clock.h>
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -144,6 +154,36 @@ V(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+#if OPT_A3
+int
+P_timed(struct semaphore *sem, uint64_t when)
+{
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		/* As in P. */
+		wchan_lock(sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		result = wchan_sleep_timeout(sem->sem_wchan, when);
+
+		spinlock_acquire(&sem->sem_lock);
+		if (result && sem->sem_count == 0) {
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+	}
+
+	KASSERT(sem->sem_count > 0);
+	sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
@@ -177,6 +217,10 @@ lock_create(const char *name)
 
 	lock->lk_held = false; 
 	lock->lk_owner = NULL;
+#if OPT_A3
+	lock->lk_waiters = 0;
+	lock->lk_handoff = false;
+#endif
 
 	return lock;
 }
@@ -194,14 +238,151 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+#if OPT_A3
+/*
+ * How many times lock_spin looks at the lock before giving up. Long
+ * enough to cover a short critical section, like bumping a counter
+ * or a list operation, with the holder running.
+ */
+#define LOCK_SPINLIMIT	1000
+
+/*
+ * Wait for LOCK, held by OWNER, to come free, but only while OWNER
+ * is running on another cpu, and only for LOCK_SPINLIMIT tries.
+ * Returns true if the lock looked free, false if the caller should
+ * sleep instead. Called without lk_spinlock, so everything it reads
+ * is only a hint. Even if OWNER has since exited, its thread
+ * structure is in direct-mapped kernel memory, so reading it can't
+ * fault.
+ */
+static
+bool
+lock_spin(struct lock *lock, struct thread *owner)
+{
+	struct cpu *c;
+	unsigned i;
+
+	if (owner == NULL) {
+		/* Being handed off to a sleeper */
+		return false;
+	}
+	for (i=0; i<LOCK_SPINLIMIT; i++) {
+		if (!lock->lk_held) {
+			return true;
+		}
+		c = ((volatile struct thread *)owner)->t_cpu;
+		if (lock->lk_owner != owner || c == NULL ||
+		    ((volatile struct cpu *)c)->c_curthread != owner) {
+			return false;
+		}
+	}
+	return false;
+}
+
+void
+lock_acquire(struct lock *lock)
+{
+	struct thread *owner;
+	bool handedoff = false;
+#if OPT_LOCKSTAT
+	bool contended;
+	uint64_t start;
+#endif
+
+	KASSERT(lock != NULL);
+	KASSERT(!lock_do_i_hold(lock));
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&lock->lk_spinlock);
+#if OPT_LOCKSTAT
+	contended = lock->lk_held;
+	start = contended ? lockstat_now() : 0;
+#endif
+	while (lock->lk_held && !handedoff) {
+		owner = lock->lk_owner;
+		spinlock_release(&lock->lk_spinlock);
+		if (lock_spin(lock, owner)) {
+			spinlock_acquire(&lock->lk_spinlock);
+			continue;
+		}
+		spinlock_acquire(&lock->lk_spinlock);
+		if (!lock->lk_held) {
+			break;
+		}
+
+		/* Sleep; lock_release hands us the lock when it wakes us. */
+		lock->lk_waiters++;
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_spinlock);
+		wchan_sleep(lock->lk_wchan);
+		spinlock_acquire(&lock->lk_spinlock);
+		KASSERT(lock->lk_handoff);
+		lock->lk_handoff = false;
+		handedoff = true;
+	}
+	KASSERT(handedoff || !lock->lk_held);
+	lock->lk_held = true; 
+	lock->lk_owner = curthread; 
+#if OPT_LOCKSTAT
+	lock->lk_acqtime = lockstat_now();
+	lock->lk_waittime = contended ? lock->lk_acqtime - start : 0;
+	lock->lk_contended = contended;
+#endif
+	spinlock_release(&lock->lk_spinlock);
+}
+
+void
+lock_release(struct lock *lock)
+{
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_spinlock);
+
+	KASSERT(lock->lk_held);
+	KASSERT(lock->lk_owner == curthread);
+#if OPT_LOCKSTAT
+	if (lock->lk_acqtime != 0) {
+		lockstat_record(LOCKSTAT_LOCK, lock->lk_name,
+				lock->lk_contended, lock->lk_waittime,
+				lockstat_now() - lock->lk_acqtime);
+	}
+#endif
+
+	lock->lk_owner = NULL;
+	if (lock->lk_waiters > 0) {
+		/*
+		 * Leave it held for the thread we wake, so nobody can
+		 * take it in the meantime and the thread goes back
+		 * to sleep having woken for nothing.
+		 */
+		lock->lk_waiters--;
+		lock->lk_handoff = true;
+		wchan_wakeone(lock->lk_wchan);
+	}
+	else {
+		lock->lk_held = false;
+	}
+
+	spinlock_release(&lock->lk_spinlock);
+}
+#else
 void
 lock_acquire(struct lock *lock)
 {
+#if OPT_LOCKSTAT
+	bool contended;
+	uint64_t start;
+#endif
+
 	KASSERT(lock != NULL);
 	KASSERT(!lock_do_i_hold(lock));
 	KASSERT(!curthread->t_in_interrupt);
 
 	spinlock_acquire(&lock->lk_spinlock);
+#if OPT_LOCKSTAT
+	contended = lock->lk_held;
+	start = contended ? lockstat_now() : 0;
+#endif
 	while(lock->lk_held){
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_spinlock);
@@ -211,6 +392,11 @@ lock_acquire(struct lock *lock)
 	KASSERT(!lock->lk_held);
 	lock->lk_held = true; 
 	lock->lk_owner = curthread; 
+#if OPT_LOCKSTAT
+	lock->lk_acqtime = lockstat_now();
+	lock->lk_waittime = contended ? lock->lk_acqtime - start : 0;
+	lock->lk_contended = contended;
+#endif
 	spinlock_release(&lock->lk_spinlock);
 
 }
@@ -224,6 +410,13 @@ lock_release(struct lock *lock)
 	
 	KASSERT(lock->lk_held);
 	KASSERT(lock->lk_owner == curthread);
+#if OPT_LOCKSTAT
+	if (lock->lk_acqtime != 0) {
+		lockstat_record(LOCKSTAT_LOCK, lock->lk_name,
+				lock->lk_contended, lock->lk_waittime,
+				lockstat_now() - lock->lk_acqtime);
+	}
+#endif
 	
 	lock->lk_held = false;
 	lock->lk_owner = NULL;
@@ -233,6 +426,7 @@ lock_release(struct lock *lock)
 
 	spinlock_release(&lock->lk_spinlock);
 }
+#endif /* OPT_A3 */
 
 bool
 lock_do_i_hold(struct lock *lock)
@@ -290,6 +484,60 @@ cv_destroy(struct cv *cv)
 	kfree(cv);
 }
 
+#if OPT_A3
+/*
+ * Wait morphing. Waking cv waiters while we hold the lock would only
+ * have them find it held and go back to sleep on the lock, so when
+ * the signaller holds the lock, cv_signal and cv_broadcast move them
+ * straight onto the lock's wait channel instead. lock_release then
+ * hands the lock to them there one at a time, as it does for threads
+ * asleep in lock_acquire, and only one thread is woken per release.
+ */
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, bool all)
+{
+	unsigned n;
+
+	/* We hold LOCK, so nobody can release it meanwhile. */
+	n = wchan_move(cv->cv_wchan, lock->lk_wchan, all);
+	if (n > 0) {
+		spinlock_acquire(&lock->lk_spinlock);
+		lock->lk_waiters += n;
+		spinlock_release(&lock->lk_spinlock);
+	}
+}
+
+/*
+ * Get LOCK back after sleeping on CV. If we were moved onto the
+ * lock's channel, whoever woke us handed it to us already.
+ */
+static
+void
+cv_relock(struct cv *cv, struct lock *lock)
+{
+	if (curthread->t_wchan != lock->lk_wchan) {
+		KASSERT(curthread->t_wchan == cv->cv_wchan);
+		lock_acquire(lock);
+		return;
+	}
+
+	spinlock_acquire(&lock->lk_spinlock);
+	KASSERT(lock->lk_held);
+	KASSERT(lock->lk_handoff);
+	KASSERT(lock->lk_owner == NULL);
+	lock->lk_handoff = false;
+	lock->lk_owner = curthread;
+#if OPT_LOCKSTAT
+	/* The wait was counted against the cv's channel. */
+	lock->lk_acqtime = lockstat_now();
+	lock->lk_waittime = 0;
+	lock->lk_contended = false;
+#endif
+	spinlock_release(&lock->lk_spinlock);
+}
+#endif
+
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
@@ -302,10 +550,70 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_release(lock); 
 	wchan_sleep(cv->cv_wchan); 
 	// thread wakes here 
+#if OPT_A3
+	cv_relock(cv, lock);
+#else
 	lock_acquire(lock); 
+#endif
 
 }
 
+#if OPT_A3
+int
+cv_timedwait(struct cv *cv, struct lock *lock, uint64_t when)
+{
+	int result;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+	KASSERT(!curthread->t_in_interrupt);
+
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_wchan, when);
+	if (result == ETIMEDOUT) {
+		/* Never moved, and maybe never asleep; t_wchan is stale. */
+		lock_acquire(lock);
+	}
+	else {
+		cv_relock(cv, lock);
+	}
+	return result;
+}
+#endif
+
+#if OPT_A3
+void
+cv_signal(struct cv *cv, struct lock *lock)
+{
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(!curthread->t_in_interrupt);
+
+	if (lock_do_i_hold(lock)) {
+		cv_morph(cv, lock, false);
+	}
+	else {
+		wchan_wakeone(cv->cv_wchan);
+	}
+}
+
+void
+cv_broadcast(struct cv *cv, struct lock *lock)
+{
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(!curthread->t_in_interrupt);
+
+	if (lock_do_i_hold(lock)) {
+		cv_morph(cv, lock, true);
+	}
+	else {
+		wchan_wakeall(cv->cv_wchan);
+	}
+}
+#else
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -327,3 +635,158 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	(void)lock;  
 
 }
+#endif /* OPT_A3 */
+
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writing = false;
+	rw->rw_writer = NULL;
+	rw->rw_rwaiting = 0;
+	rw->rw_wwaiting = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(!rw->rw_writing);
+
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_rwchan);
+	wchan_destroy(rw->rw_wwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (!rw->rw_writing && rw->rw_wwaiting == 0) {
+		rw->rw_readers++;
+		spinlock_release(&rw->rw_lock);
+		return;
+	}
+
+	/* rwlock_release_write counts us in before waking us. */
+	rw->rw_rwaiting++;
+	wchan_lock(rw->rw_rwchan);
+	spinlock_release(&rw->rw_lock);
+	wchan_sleep(rw->rw_rwchan);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(!rw->rw_writing);
+
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		/* Last of the batch; hand over to a writer. */
+		rw->rw_wwaiting--;
+		rw->rw_writing = true;
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	if (!rw->rw_writing && rw->rw_readers == 0) {
+		rw->rw_writing = true;
+	}
+	else {
+		/* Whoever wakes us sets rw_writing for us. */
+		rw->rw_wwaiting++;
+		wchan_lock(rw->rw_wwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_wwchan);
+		spinlock_acquire(&rw->rw_lock);
+		KASSERT(rw->rw_writing);
+		KASSERT(rw->rw_writer == NULL);
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writing);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+
+	rw->rw_writer = NULL;
+	if (rw->rw_rwaiting > 0) {
+		/* Let in everyone who was waiting to read, as a batch. */
+		rw->rw_writing = false;
+		rw->rw_readers = rw->rw_rwaiting;
+		rw->rw_rwaiting = 0;
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	else if (rw->rw_wwaiting > 0) {
+		/* Straight on to the next writer; stays rw_writing. */
+		rw->rw_wwaiting--;
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	else {
+		rw->rw_writing = false;
+	}
+	spinlock_release(&rw->rw_lock);
+}
+#endif /* OPT_A3 */
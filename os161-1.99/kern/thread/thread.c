@@ -52,6 +52,16 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <clock.h>
+#include <kmem_cache.h>
+#include <counter.h>
+#endif
+#include "opt-lockstat.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +82,36 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+#if OPT_A3
+/*
+ * Thread structures come from an object cache. A free thread keeps
+ * its list node and machine-dependent state as thread_destroy's
+ * cleanup checks leave them.
+ */
+static struct kmem_cache *thread_cache;
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+/*
+ * Each cpu keeps up to THREADPOOL_MAX dead threads, stacks and all,
+ * so thread_fork can usually take one off the list instead of going
+ * to kmalloc for the thread, and especially for the page-sized stack.
+ * The most recently dead thread goes out first, while its stack may
+ * still be in the cache. The pool is per-cpu, so we need only keep
+ * interrupts off (so we can't be preempted and moved) to use it.
+ */
+#define THREADPOOL_MAX	8
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +151,37 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+#if OPT_A3
+/*
+ * Set the fields every new thread starts out with: all but the name,
+ * the stack, and what thread_ctor does. For threads from thread_cache
+ * and from a cpu's thread pool alike.
+ *
+ * If you add to struct thread, be sure to initialize here.
+ */
+static
+void
+thread_reset(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_prio = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+	thread->t_wchan = NULL;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+}
+#endif
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,16 +194,29 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
+#if OPT_A3
+	thread = kmem_cache_alloc(thread_cache);
+#else
 	thread = kmalloc(sizeof(*thread));
+#endif
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(thread_cache, thread);
+#else
 		kfree(thread);
+#endif
 		return NULL;
 	}
+#if OPT_A3
+	/* thread_ctor did the list node and machine-dependent state. */
+	thread->t_stack = NULL;
+	thread_reset(thread);
+#else
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
@@ -150,10 +234,66 @@ thread_create(const char *name)
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+#endif
+
+	return thread;
+}
+
+#if OPT_A3
+/*
+ * Get a thread, with its stack, from this cpu's pool, and give it
+ * NAME. Returns NULL if the pool is empty or we're out of memory.
+ */
+static
+struct thread *
+threadpool_get(const char *name)
+{
+	struct thread *thread;
+	char *tname;
+	int spl;
+
+	tname = kstrdup(name);
+	if (tname == NULL) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
 
+	if (thread == NULL) {
+		kfree(tname);
+		return NULL;
+	}
+	KASSERT(thread->t_stack != NULL);
+	thread->t_name = tname;
+	thread_reset(thread);
 	return thread;
 }
 
+/*
+ * Put a dead thread, with its stack, in this cpu's pool, unless the
+ * pool is full. Returns true if it took the thread.
+ */
+static
+bool
+threadpool_put(struct thread *thread)
+{
+	bool taken;
+	int spl;
+
+	KASSERT(thread->t_stack != NULL);
+
+	spl = splhigh();
+	taken = curcpu->c_threadpool.tl_count < THREADPOOL_MAX;
+	if (taken) {
+		threadlist_addhead(&curcpu->c_threadpool, thread);
+	}
+	splx(spl);
+	return taken;
+}
+#endif
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -168,6 +308,9 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+#if OPT_A3
+	unsigned i;
+#endif
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,9 +323,26 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+#if OPT_A3
+	pagecache_init(&c->c_pagecache);
+	c->c_tlbused = 0;
+	c->c_tlbnext = 0;
+	c->c_asidgen = 0;
+	c->c_asid = 0;
+	kmags_init(&c->c_kmags);
+	threadlist_init(&c->c_threadpool);
+	bzero(c->c_counters, sizeof(c->c_counters));
+#endif
 
 	c->c_isidle = false;
+#if OPT_A3
+	for (i=0; i<SCHED_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+#else
 	threadlist_init(&c->c_runqueue);
+#endif
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -227,6 +387,23 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+#if OPT_A3
+/*
+ * Number of cpus, and lookup by software number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	return cpuarray_get(&allcpus, software_number);
+}
+#endif /* OPT_A3 */
+
 /*
  * Destroy a thread.
  *
@@ -249,6 +426,26 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
+#if OPT_A3
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+
+	/* sheer paranoia */
+	thread->t_wchan_name = "DESTROYED";
+
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	if (thread->t_stack != NULL) {
+		/* Don't hand out a stack that's been overrun. */
+		thread_checkstack(thread);
+		if (threadpool_put(thread)) {
+			return;
+		}
+		kfree(thread->t_stack);
+	}
+	kmem_cache_free(thread_cache, thread);
+#else
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
@@ -260,6 +457,7 @@ thread_destroy(struct thread *thread)
 
 	kfree(thread->t_name);
 	kfree(thread);
+#endif
 }
 
 /*
@@ -289,6 +487,10 @@ exorcise(void)
 void
 thread_panic(void)
 {
+#if OPT_A3
+	unsigned i;
+
+#endif
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +505,18 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
+#if OPT_A3
+	for (i=0; i<SCHED_NPRIO; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
+#else
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+#endif
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +562,14 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+#if OPT_A3
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+#endif
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -426,6 +645,211 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+#if OPT_A3
+/*
+ * Run queue access. There is one queue per priority level; threads
+ * are queued at the tail of their level and taken from the head of
+ * the highest non-empty level. Call with the cpu's run queue lock
+ * held.
+ */
+static
+void
+runq_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_prio < SCHED_NPRIO);
+	threadlist_addtail(&c->c_runqueue[t->t_prio], t);
+	c->c_runcount++;
+}
+
+/* Take the next thread to run, or NULL. */
+static
+struct thread *
+runq_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NPRIO; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last, or NULL. */
+static
+struct thread *
+runq_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NPRIO; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Is anything queued at a level better than PRIO? */
+static
+bool
+runq_hasbetter(struct cpu *c, unsigned prio)
+{
+	unsigned i;
+
+	for (i=0; i<prio; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Work stealing. A cpu with nothing to run takes a thread from the
+ * tail of the busiest other cpu's run queue before it idles, and
+ * again every time the timer wakes it from idling, so work spreads
+ * out as soon as there is a cpu free to take it rather than waiting
+ * for the busy cpu to push it away.
+ *
+ * Threads that ran on the victim in the last STEAL_HOT_HARDCLOCKS
+ * hardclocks probably still have their working set in its cache, so
+ * we take them only if nothing colder is queued and the victim has a
+ * backlog, that is, if the thread would otherwise wait behind others.
+ */
+#define STEAL_HOT_HARDCLOCKS	2
+
+/*
+ * Pick a thread to steal from C's run queue and take it off, or
+ * return NULL. Call with C's run queue lock held.
+ */
+static
+struct thread *
+runq_steal(struct cpu *c)
+{
+	struct thread *t, *pick, *hot;
+	unsigned i;
+
+	pick = hot = NULL;
+	for (i=SCHED_NPRIO; i-- > 0 && pick == NULL; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			/*
+			 * A cpu's curthread can be on its own run queue
+			 * if it slept, the cpu went idle, and it was woken
+			 * before the cpu finished unidling. It can't be
+			 * moved.
+			 */
+			if (t == c->c_curthread) {
+				continue;
+			}
+			/* c_hardclocks isn't ours; it's only a hint. */
+			if (c->c_hardclocks - t->t_lastrun >=
+			    STEAL_HOT_HARDCLOCKS) {
+				pick = t;
+				break;
+			}
+			if (hot == NULL) {
+				hot = t;
+			}
+		}
+	}
+	if (pick == NULL) {
+		if (hot == NULL || c->c_runcount < 2) {
+			return NULL;
+		}
+		pick = hot;
+	}
+	threadlist_remove(&c->c_runqueue[pick->t_prio], pick);
+	c->c_runcount--;
+	return pick;
+}
+
+/*
+ * Steal a thread for the current cpu, which is idle, or return NULL.
+ * Call without holding any run queue lock.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	/*
+	 * Choose the cpu with the most queued threads. The counts are
+	 * read unlocked; they're only a hint. Start the scan after
+	 * ourselves so idle cpus spread out over equally busy ones.
+	 */
+	numcpus = cpuarray_num(&allcpus);
+	victim = NULL;
+	most = 0;
+	for (i=1; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (curcpu->c_number + i) % numcpus);
+		if (c->c_runcount > most) {
+			most = c->c_runcount;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runq_steal(victim);
+	spinlock_release(&victim->c_runqueue_lock);
+	if (t == NULL) {
+		return NULL;
+	}
+
+	/* Nobody else can find it now, so no lock needed. */
+	t->t_cpu = curcpu->c_self;
+	_counter_inc(CNT_SCHED_STEAL);
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return t;
+}
+
+/*
+ * Idle cpus don't take hardclocks, so they don't look for work to
+ * steal on their own; when a busy cpu C has threads waiting, wake up
+ * an idle one to come and take some. The c_isidle flags are read
+ * unlocked; at worst we wake a cpu for nothing or miss one until
+ * C's next hardclock.
+ */
+static
+void
+thread_kick_idle(struct cpu *c)
+{
+	struct cpu *other;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=1; i<numcpus; i++) {
+		other = cpuarray_get(&allcpus, (c->c_number + i) % numcpus);
+		if (other->c_isidle) {
+			ipi_send(other, IPI_UNIDLE);
+			counter_inc(CNT_SCHED_KICK);
+			return;
+		}
+	}
+}
+
+#define runq_count(c)	((c)->c_runcount)
+#else
+#define runq_add(c, t)	threadlist_addtail(&(c)->c_runqueue, (t))
+#define runq_remhead(c)	threadlist_remhead(&(c)->c_runqueue)
+#define runq_remtail(c)	threadlist_remtail(&(c)->c_runqueue)
+#define runq_count(c)	((c)->c_runqueue.tl_count)
+#endif /* OPT_A3 */
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +874,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runq_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +882,12 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+#if OPT_A3
+	else {
+		/* Busy; get an idle cpu to come and take it. */
+		thread_kick_idle(targetcpu);
+	}
+#endif
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -487,13 +917,27 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
+#if OPT_A3
+	/* A thread from the pool comes with a stack. */
+	newthread = threadpool_get(name);
+	if (newthread == NULL) {
+		newthread = thread_create(name);
+	}
+#else
 	newthread = thread_create(name);
+#endif
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
 	/* Allocate a stack */
+#if OPT_A3
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+	}
+#else
 	newthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -506,6 +950,10 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+#if OPT_A3
+	/* Start where the parent is, so forking doesn't buy priority. */
+	newthread->t_prio = curthread->t_prio;
+#endif
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -549,6 +997,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
 	int spl;
+#if OPT_A3
+	bool tickless = false;
+#endif
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
 	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
@@ -574,12 +1025,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runq_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+#if OPT_A3
+	/* Before it's on any list where a thief could see it. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+#endif
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -589,6 +1045,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+#if OPT_A3
+		cur->t_wchan = wc;
+#endif
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -632,14 +1091,32 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runq_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			/* Look for work elsewhere before going to sleep. */
+			next = thread_steal();
+			if (next == NULL) {
+				/* No ticks until there's work again. */
+				mainbus_hardclock_stop();
+				tickless = true;
+				_counter_inc(CNT_SCHED_IDLE);
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+#if OPT_A3
+	if (tickless) {
+		mainbus_hardclock_start();
+	}
+	_counter_inc(CNT_SCHED_SWITCH);
+#endif
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -826,15 +1303,107 @@ thread_yield(void)
  * the current CPU's run queue by job priority.
  */
 
+#if OPT_A3
+/*
+ * Multilevel feedback queue. A thread at level p gets a quantum of
+ * SCHED_QUANTUM(p) hardclocks; using it all up (counted across any
+ * sleeps in between, so sleeping just before the end doesn't reset
+ * it) drops the thread a level. Being woken up raises it a level. So
+ * threads that mostly wait, like the shell or anything talking to the
+ * console, stay near the top, and CPU hogs sink to the bottom, where
+ * they get longer quanta. Once a second schedule() puts everything
+ * back at the top so nothing starves.
+ */
+#define SCHED_QUANTUM(prio)	(1U << (prio))
+#define SCHED_BOOST_HARDCLOCKS	HZ
+
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool expired, better, waiting;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* curthread isn't really running; nothing to charge */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
+	}
+
+	expired = ++cur->t_ticks >= SCHED_QUANTUM(cur->t_prio);
+	if (expired) {
+		_counter_inc(CNT_SCHED_EXPIRE);
+		cur->t_ticks = 0;
+		if (cur->t_prio < SCHED_NPRIO - 1) {
+			cur->t_prio++;
+		}
+	}
+	better = runq_hasbetter(curcpu, cur->t_prio);
+	waiting = runq_count(curcpu) > 0;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	/*
+	 * thread_make_runnable kicks an idle cpu as each thread is
+	 * queued; this only catches cpus that went idle since, and a
+	 * thief passes over threads run in the last STEAL_HOT_HARDCLOCKS
+	 * where it can, so there's no use kicking more often than that.
+	 */
+	if (waiting && curcpu->c_hardclocks % STEAL_HOT_HARDCLOCKS == 0) {
+		thread_kick_idle(curcpu->c_self);
+	}
+
+	return expired || better;
+}
+
+/*
+ * Priority boost for a thread being woken up. The thread isn't on
+ * any run queue yet, so only its waker can be looking at it.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_prio > 0) {
+		t->t_prio--;
+	}
+}
+#endif /* OPT_A3 */
+
 void
 schedule(void)
 {
+#if OPT_A3
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS != 0) {
+		return;
+	}
+
+	/* Anti-starvation: everything back to the top level. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NPRIO; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_prio = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+#else
 	/*
 	 * You can write this. If we do nothing, threads will run in
 	 * round-robin fashion.
 	 */
+#endif
 }
 
+#if !OPT_A3
 /*
  * Thread migration.
  *
@@ -866,9 +1435,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runq_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runq_count(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -882,7 +1451,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runq_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -893,7 +1462,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runq_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -924,7 +1493,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runq_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1517,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runq_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -956,6 +1525,7 @@ thread_consider_migration(void)
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
 }
+#endif /* !OPT_A3 */
 
 ////////////////////////////////////////////////////////////
 
@@ -1022,12 +1592,106 @@ wchan_unlock(struct wchan *wc)
 void
 wchan_sleep(struct wchan *wc)
 {
+#if OPT_LOCKSTAT
+	struct lockstat_sleep ls;
+#endif
+
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+#if OPT_LOCKSTAT
+	lockstat_sleep_start(&ls, wc->wc_name);
+#endif
 	thread_switch(S_SLEEP, wc);
+#if OPT_LOCKSTAT
+	lockstat_sleep_done(&ls);
+#endif
 }
 
+#if OPT_A3
+/*
+ * A thread in wchan_sleep_timeout. Lives on that thread's stack.
+ */
+struct wchan_sleeper {
+	struct wchan *ws_wchan;
+	struct thread *ws_thread;
+	bool ws_timedout;
+};
+
+/*
+ * Timeout function for wchan_sleep_timeout: wake the thread if it's
+ * still asleep on the channel. It can't have left wchan_sleep_timeout
+ * yet, because that cancels the timeout first, and timeout_cancel
+ * waits for us to finish.
+ */
+static
+void
+wchan_timedout(void *vws)
+{
+	struct wchan_sleeper *ws = vws;
+	struct wchan *wc = ws->ws_wchan;
+	struct thread *t;
+	bool found = false;
+
+	spinlock_acquire(&wc->wc_lock);
+	THREADLIST_FORALL(t, wc->wc_threads) {
+		if (t == ws->ws_thread) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		threadlist_remove(&wc->wc_threads, t);
+		ws->ws_timedout = true;
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (found) {
+		thread_wakeboost(t);
+		thread_make_runnable(t, false);
+	}
+}
+
+int
+wchan_sleep_timeout(struct wchan *wc, uint64_t when)
+{
+	struct wchan_sleeper ws;
+	struct timeout to;
+#if OPT_LOCKSTAT
+	struct lockstat_sleep ls;
+#endif
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	if (clock_nsecs() >= when) {
+		spinlock_release(&wc->wc_lock);
+		return ETIMEDOUT;
+	}
+
+	ws.ws_wchan = wc;
+	ws.ws_thread = curthread;
+	ws.ws_timedout = false;
+	timeout_init(&to, wchan_timedout, &ws);
+
+	/*
+	 * The timeout can't wake us before we're asleep, because it
+	 * needs the channel lock, which we hold until then.
+	 */
+	timeout_set(&to, when);
+#if OPT_LOCKSTAT
+	lockstat_sleep_start(&ls, wc->wc_name);
+#endif
+	thread_switch(S_SLEEP, wc);
+#if OPT_LOCKSTAT
+	lockstat_sleep_done(&ls);
+#endif
+	timeout_cancel(&to);
+
+	return ws.ws_timedout ? ETIMEDOUT : 0;
+}
+#endif /* OPT_A3 */
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,9 +1714,42 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+#if OPT_A3
+	thread_wakeboost(target);
+#endif
 	thread_make_runnable(target, false);
 }
 
+#if OPT_A3
+/*
+ * Move the first thread, or all threads, sleeping on FROM over to TO
+ * without waking them.
+ */
+unsigned
+wchan_move(struct wchan *from, struct wchan *to, bool all)
+{
+	struct thread *t;
+	unsigned n;
+
+	KASSERT(from != to);
+
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	for (n = 0; n == 0 || all; n++) {
+		t = threadlist_remhead(&from->wc_threads);
+		if (t == NULL) {
+			break;
+		}
+		t->t_wchan_name = to->wc_name;
+		t->t_wchan = to;
+		threadlist_addtail(&to->wc_threads, t);
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+	return n;
+}
+#endif
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
@@ -1084,6 +1781,9 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+#if OPT_A3
+		thread_wakeboost(target);
+#endif
 		thread_make_runnable(target, false);
 	}
 
@@ -0,0 +1,759 @@
+/*
+ * Buddy allocator for physical frames. See coremap.h for the overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * A free block of order k has ce_npages == 2^k in its first frame.
+ */
+#define CM_ISFREEHEAD(ce, order) \
+	(((ce)->ce_flags & CMF_FREE) && (ce)->ce_npages == (1U << (order)))
+
+/*
+ * Largest block order. 2^17 frames of 4k is 512M, which is all of
+ * kseg0 and so everything we could possibly be asked to manage.
+ */
+#define CM_NORDERS	18
+
+/*
+ * Free list node, stored in the first frame of each free block.
+ */
+struct cm_freeblock {
+	struct cm_freeblock *fb_next;
+	struct cm_freeblock *fb_prev;
+};
+
+static struct spinlock cm_lock = SPINLOCK_INITIALIZER;
+
+static struct cm_entry *cm;		/* coremap */
+static unsigned cm_nframes;		/* # of frames in the coremap */
+static paddr_t cm_base;			/* physical address of frame 0 */
+
+static struct cm_freeblock *cm_freelists[CM_NORDERS];
+static unsigned cm_nfree[CM_NORDERS];	/* # of blocks on each list */
+
+static unsigned cm_clockhand;		/* next frame the clock looks at */
+
+/*
+ * The first frame of a run of one frame; a user page always is one.
+ */
+#define CM_SINGLE(ce) \
+	(((ce)->ce_flags & CMF_ALLOC) && \
+	 (((ce)->ce_flags & CMF_USER) || (ce)->ce_npages == 1))
+
+/*
+ * A frame that may be evicted: an unpinned user page with one owner,
+ * though ce_owner may not say who that is.
+ */
+#define CM_EVICTABLE(ce) \
+	(((ce)->ce_flags & (CMF_ALLOC | CMF_USER | CMF_PINNED)) == \
+	 (CMF_ALLOC | CMF_USER) && (ce)->ce_refcount == 1)
+
+////////////////////////////////////////////////////////////
+//
+// Free list handling
+
+static
+inline
+struct cm_freeblock *
+cm_block(unsigned frame)
+{
+	return (struct cm_freeblock *)
+		PADDR_TO_KVADDR(cm_base + frame * PAGE_SIZE);
+}
+
+static
+inline
+unsigned
+cm_frame(struct cm_freeblock *fb)
+{
+	return (KVADDR_TO_PADDR((vaddr_t)fb) - cm_base) / PAGE_SIZE;
+}
+
+static
+void
+cm_list_add(unsigned frame, unsigned order)
+{
+	struct cm_freeblock *fb;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(order < CM_NORDERS);
+	KASSERT(frame % (1U << order) == 0);
+
+	fb = cm_block(frame);
+	fb->fb_prev = NULL;
+	fb->fb_next = cm_freelists[order];
+	if (fb->fb_next != NULL) {
+		fb->fb_next->fb_prev = fb;
+	}
+	cm_freelists[order] = fb;
+	cm_nfree[order]++;
+	cm[frame].ce_flags = CMF_FREE;
+	cm[frame].ce_npages = 1U << order;
+}
+
+static
+void
+cm_list_remove(unsigned frame, unsigned order)
+{
+	struct cm_freeblock *fb;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(CM_ISFREEHEAD(&cm[frame], order));
+
+	fb = cm_block(frame);
+	if (fb->fb_prev != NULL) {
+		fb->fb_prev->fb_next = fb->fb_next;
+	}
+	else {
+		cm_freelists[order] = fb->fb_next;
+	}
+	if (fb->fb_next != NULL) {
+		fb->fb_next->fb_prev = fb->fb_prev;
+	}
+	KASSERT(cm_nfree[order] > 0);
+	cm_nfree[order]--;
+	cm[frame].ce_flags = 0;
+	cm[frame].ce_npages = 0;
+}
+
+/*
+ * Put a free block back, merging it with its buddy for as long as
+ * the buddy is also a whole free block of the same order.
+ */
+static
+void
+cm_freeblock(unsigned frame, unsigned order)
+{
+	unsigned buddy;
+
+	while (order + 1 < CM_NORDERS) {
+		buddy = frame ^ (1U << order);
+		if (buddy + (1U << order) > cm_nframes ||
+		    !CM_ISFREEHEAD(&cm[buddy], order)) {
+			break;
+		}
+		cm_list_remove(buddy, order);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	cm_list_add(frame, order);
+}
+
+/*
+ * Free an arbitrary range of frames by carving it into the largest
+ * aligned blocks that fit.
+ */
+static
+void
+cm_freerange(unsigned frame, unsigned nframes)
+{
+	unsigned order;
+
+	while (nframes > 0) {
+		order = 0;
+		while (order + 1 < CM_NORDERS &&
+		       frame % (2U << order) == 0 &&
+		       (2U << order) <= nframes) {
+			order++;
+		}
+		cm_freeblock(frame, order);
+		frame += 1U << order;
+		nframes -= 1U << order;
+	}
+}
+
+/*
+ * Smallest order whose blocks hold NPAGES frames.
+ */
+static
+unsigned
+cm_order(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Allocate a run from the buddy lists. Returns the first frame, or
+ * -1 if nothing fits.
+ */
+static
+int
+cm_alloc(unsigned long npages)
+{
+	unsigned order, o, frame;
+	struct cm_entry *ce;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(npages > 0);
+
+	order = cm_order(npages);
+	if (order >= CM_NORDERS) {
+		return -1;
+	}
+
+	for (o = order; o < CM_NORDERS && cm_freelists[o] == NULL; o++) {
+		/* nothing */
+	}
+	if (o == CM_NORDERS) {
+		return -1;
+	}
+
+	frame = cm_frame(cm_freelists[o]);
+	cm_list_remove(frame, o);
+
+	/* Split down to the order we need; upper halves go back. */
+	while (o > order) {
+		o--;
+		cm_list_add(frame + (1U << o), o);
+	}
+
+	/* Hand back the part of the block past the end of the run. */
+	cm_freerange(frame + npages, (1U << order) - npages);
+
+	ce = &cm[frame];
+	ce->ce_owner = NULL;
+	ce->ce_npages = npages;
+	ce->ce_refcount = 1;
+	ce->ce_flags = CMF_ALLOC | CMF_PINNED;
+	ce->ce_slot = CM_NOSLOT;
+
+	return frame;
+}
+
+/*
+ * Free the run starting at FRAME back to the buddy lists.
+ */
+static
+void
+cm_free(unsigned frame)
+{
+	struct cm_entry *ce;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	ce = &cm[frame];
+	if ((ce->ce_flags & CMF_ALLOC) == 0) {
+		panic("coremap_free: 0x%x is not the start of a run\n",
+		      cm_base + frame * PAGE_SIZE);
+	}
+	KASSERT((ce->ce_flags & CMF_USER) == 0);
+
+	n = ce->ce_npages;
+	ce->ce_owner = NULL;
+	ce->ce_npages = 0;
+	ce->ce_refcount = 0;
+	ce->ce_flags = 0;
+	ce->ce_slot = CM_NOSLOT;
+
+	cm_freerange(frame, n);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu page caches
+
+void
+pagecache_init(struct pagecache *pc)
+{
+	pc->pc_count = 0;
+	pc->pc_allochits = 0;
+	pc->pc_allocmisses = 0;
+	pc->pc_freehits = 0;
+	pc->pc_freemisses = 0;
+}
+
+/*
+ * Pull up to PAGECACHE_BATCH single frames off the buddy lists.
+ */
+static
+void
+pagecache_refill(struct pagecache *pc)
+{
+	int frame;
+
+	spinlock_acquire(&cm_lock);
+	while (pc->pc_count < PAGECACHE_BATCH) {
+		frame = cm_alloc(1);
+		if (frame < 0) {
+			break;
+		}
+		pc->pc_frames[pc->pc_count++] = cm_base + frame * PAGE_SIZE;
+	}
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Give the N oldest cached frames back to the buddy lists.
+ */
+static
+void
+pagecache_drain(struct pagecache *pc, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(n <= pc->pc_count);
+
+	spinlock_acquire(&cm_lock);
+	for (i=0; i<n; i++) {
+		cm_free((pc->pc_frames[i] - cm_base) / PAGE_SIZE);
+	}
+	spinlock_release(&cm_lock);
+
+	for (i=n; i<pc->pc_count; i++) {
+		pc->pc_frames[i-n] = pc->pc_frames[i];
+	}
+	pc->pc_count -= n;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned cm_pages, i;
+
+	ram_getsize(&lo, &hi);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+	hi &= PAGE_FRAME;
+	KASSERT(hi > lo);
+
+	cm_base = lo;
+	cm_nframes = (hi - lo) / PAGE_SIZE;
+
+	/* The descriptors live in the first frames they describe. */
+	COMPILE_ASSERT(sizeof(struct cm_entry) == 12);
+	KASSERT(cm_nframes < (1U << 20));
+	cm_pages = DIVROUNDUP(cm_nframes * sizeof(struct cm_entry), PAGE_SIZE);
+	KASSERT(cm_pages < cm_nframes);
+	cm = (struct cm_entry *)PADDR_TO_KVADDR(cm_base);
+
+	spinlock_acquire(&cm_lock);
+	for (i=0; i<cm_nframes; i++) {
+		cm[i].ce_owner = NULL;
+		cm[i].ce_npages = 0;
+		cm[i].ce_refcount = 0;
+		cm[i].ce_flags = 0;
+		cm[i].ce_slot = CM_NOSLOT;
+	}
+	cm[0].ce_npages = cm_pages;
+	cm[0].ce_refcount = 1;
+	cm[0].ce_flags = CMF_ALLOC | CMF_PINNED;
+	cm_freerange(cm_pages, cm_nframes - cm_pages);
+	spinlock_release(&cm_lock);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	struct pagecache *pc;
+	paddr_t pa;
+	int frame, spl;
+
+	if (npages == 1) {
+		/* Stay on this cpu while we use its cache. */
+		spl = splhigh();
+		pc = &curcpu->c_pagecache;
+		if (pc->pc_count > 0) {
+			pc->pc_allochits++;
+		}
+		else {
+			pc->pc_allocmisses++;
+			pagecache_refill(pc);
+		}
+		pa = 0;
+		if (pc->pc_count > 0) {
+			pa = pc->pc_frames[--pc->pc_count];
+		}
+		splx(spl);
+		return pa;
+	}
+
+	spinlock_acquire(&cm_lock);
+	frame = cm_alloc(npages);
+	spinlock_release(&cm_lock);
+
+	if (frame < 0) {
+		/*
+		 * Cached frames can keep blocks from coalescing.
+		 * Give ours back and try once more.
+		 */
+		spl = splhigh();
+		pc = &curcpu->c_pagecache;
+		pagecache_drain(pc, pc->pc_count);
+		splx(spl);
+
+		spinlock_acquire(&cm_lock);
+		frame = cm_alloc(npages);
+		spinlock_release(&cm_lock);
+		if (frame < 0) {
+			return 0;
+		}
+	}
+
+	return cm_base + frame * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	struct pagecache *pc;
+	unsigned frame;
+	int spl;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (paddr < cm_base) {
+		/* Stolen before the coremap existed; can't be freed. */
+		return;
+	}
+	frame = (paddr - cm_base) / PAGE_SIZE;
+	KASSERT(frame < cm_nframes);
+
+	/*
+	 * A shared frame only loses a reference. Nobody can add one
+	 * without holding one, so if we see a count of 1 unlocked it
+	 * is ours alone. Down to one, it can be evicted again by
+	 * whoever holds the last reference.
+	 */
+	if (cm[frame].ce_refcount > 1) {
+		spinlock_acquire(&cm_lock);
+		if (cm[frame].ce_refcount > 1) {
+			cm[frame].ce_refcount--;
+			if (cm[frame].ce_refcount == 1) {
+				cm[frame].ce_flags &= ~CMF_PINNED;
+			}
+			spinlock_release(&cm_lock);
+			return;
+		}
+		spinlock_release(&cm_lock);
+	}
+
+	/*
+	 * The caller owns this run, so its descriptor can't change
+	 * under us and we can check for a single page without cm_lock.
+	 */
+	if (CM_SINGLE(&cm[frame])) {
+		KASSERT(cm[frame].ce_slot == CM_NOSLOT);
+		if (cm[frame].ce_flags & CMF_USER) {
+			/* Keep the clock off it while it sits in a cache. */
+			spinlock_acquire(&cm_lock);
+			cm[frame].ce_owner = NULL;
+			cm[frame].ce_npages = 1;
+			cm[frame].ce_flags = CMF_ALLOC | CMF_PINNED;
+			spinlock_release(&cm_lock);
+		}
+		spl = splhigh();
+		pc = &curcpu->c_pagecache;
+		if (pc->pc_count < PAGECACHE_SIZE) {
+			pc->pc_freehits++;
+		}
+		else {
+			pc->pc_freemisses++;
+			pagecache_drain(pc, PAGECACHE_BATCH);
+		}
+		pc->pc_frames[pc->pc_count++] = paddr;
+		splx(spl);
+		return;
+	}
+
+	spinlock_acquire(&cm_lock);
+	cm_free(frame);
+	spinlock_release(&cm_lock);
+}
+
+void
+coremap_share(paddr_t paddr, vaddr_t vaddr)
+{
+	struct cm_entry *ce;
+
+	KASSERT(paddr >= cm_base);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(CM_SINGLE(ce));
+	KASSERT(ce->ce_refcount > 0 && ce->ce_refcount < 0xffff);
+	ce->ce_refcount++;
+	/* No single owner any more. */
+	ce->ce_owner = NULL;
+	ce->ce_vpn = vaddr / PAGE_SIZE;
+	ce->ce_flags |= CMF_USER | CMF_PINNED;
+	spinlock_release(&cm_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	KASSERT(paddr >= cm_base);
+	return cm[(paddr - cm_base) / PAGE_SIZE].ce_refcount;
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *ce;
+
+	KASSERT(paddr >= cm_base);
+	KASSERT(as != NULL);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(CM_SINGLE(ce));
+	KASSERT(ce->ce_refcount == 1);
+	ce->ce_owner = as;
+	ce->ce_vpn = vaddr / PAGE_SIZE;
+	ce->ce_flags = (ce->ce_flags & ~CMF_PINNED) | CMF_USER | CMF_REF;
+	spinlock_release(&cm_lock);
+}
+
+void
+coremap_pin(paddr_t paddr)
+{
+	struct cm_entry *ce;
+
+	KASSERT(paddr >= cm_base);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(ce->ce_flags & CMF_ALLOC);
+	ce->ce_flags |= CMF_PINNED;
+	spinlock_release(&cm_lock);
+}
+
+bool
+coremap_evictable(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *ce;
+	bool ret;
+
+	KASSERT(paddr >= cm_base);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	ret = CM_EVICTABLE(ce) && ce->ce_owner == as &&
+		ce->ce_vpn == vaddr / PAGE_SIZE;
+	spinlock_release(&cm_lock);
+	return ret;
+}
+
+/*
+ * Second-chance clock: sweep the coremap, clearing CMF_REF, and stop
+ * at the first evictable frame that didn't have it set. Two passes
+ * are enough to find one if there is any.
+ */
+paddr_t
+coremap_victim(struct addrspace **as, vaddr_t *vaddr, bool cleanonly)
+{
+	struct cm_entry *ce;
+	unsigned i, frame;
+
+	spinlock_acquire(&cm_lock);
+	for (i=0; i<2*cm_nframes; i++) {
+		frame = cm_clockhand;
+		cm_clockhand = (cm_clockhand + 1) % cm_nframes;
+
+		ce = &cm[frame];
+		if (!CM_EVICTABLE(ce) ||
+		    (cleanonly && (ce->ce_flags & CMF_DIRTY))) {
+			continue;
+		}
+		if (ce->ce_flags & CMF_REF) {
+			ce->ce_flags &= ~CMF_REF;
+			continue;
+		}
+		*as = ce->ce_owner;
+		*vaddr = ce->ce_vpn * PAGE_SIZE;
+		spinlock_release(&cm_lock);
+		return cm_base + frame * PAGE_SIZE;
+	}
+	spinlock_release(&cm_lock);
+	return 0;
+}
+
+void
+coremap_setslot(paddr_t paddr, unsigned slot)
+{
+	struct cm_entry *ce;
+
+	KASSERT(paddr >= cm_base);
+	KASSERT(slot <= CM_NOSLOT);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(CM_SINGLE(ce));
+	KASSERT(ce->ce_slot == CM_NOSLOT);
+	ce->ce_slot = slot;
+	ce->ce_flags &= ~CMF_DIRTY;
+	spinlock_release(&cm_lock);
+}
+
+unsigned
+coremap_takeslot(paddr_t paddr)
+{
+	struct cm_entry *ce;
+	unsigned slot;
+
+	KASSERT(paddr >= cm_base);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	slot = ce->ce_slot;
+	ce->ce_slot = CM_NOSLOT;
+	spinlock_release(&cm_lock);
+	return slot;
+}
+
+/*
+ * Only the VM system changes CMF_DIRTY, and it serializes that with
+ * its own calls, so it can be read without cm_lock.
+ */
+bool
+coremap_isdirty(paddr_t paddr)
+{
+	KASSERT(paddr >= cm_base);
+	return (cm[(paddr - cm_base) / PAGE_SIZE].ce_flags & CMF_DIRTY) != 0;
+}
+
+unsigned
+coremap_setdirty(paddr_t paddr)
+{
+	struct cm_entry *ce;
+	unsigned slot;
+
+	KASSERT(paddr >= cm_base);
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(CM_SINGLE(ce));
+	ce->ce_flags |= CMF_DIRTY;
+	slot = ce->ce_slot;
+	ce->ce_slot = CM_NOSLOT;
+	spinlock_release(&cm_lock);
+	return slot;
+}
+
+unsigned
+coremap_nfree(void)
+{
+	unsigned order, n = 0;
+
+	spinlock_acquire(&cm_lock);
+	for (order=0; order<CM_NORDERS; order++) {
+		n += cm_nfree[order] << order;
+	}
+	spinlock_release(&cm_lock);
+	return n;
+}
+
+void
+coremap_setkmref(paddr_t paddr, void *ref)
+{
+	struct cm_entry *ce;
+
+	if (cm == NULL || paddr < cm_base) {
+		/* Stolen before the coremap existed; nowhere to put it. */
+		return;
+	}
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+
+	spinlock_acquire(&cm_lock);
+	/* The first frame of a kernel run, or one further into a run. */
+	KASSERT((ce->ce_flags & (CMF_FREE | CMF_USER)) == 0);
+	KASSERT((ce->ce_flags & (CMF_ALLOC | CMF_PINNED)) != CMF_ALLOC);
+	ce->ce_owner = ref;
+	if (ref != NULL) {
+		ce->ce_flags |= CMF_KMALLOC;
+	}
+	else {
+		ce->ce_flags &= ~CMF_KMALLOC;
+	}
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * The caller holds memory in the frame, so its descriptor is stable
+ * and can be read without cm_lock.
+ */
+bool
+coremap_getkmref(paddr_t paddr, void **ref)
+{
+	struct cm_entry *ce;
+
+	if (cm == NULL || paddr < cm_base) {
+		return false;
+	}
+	ce = &cm[(paddr - cm_base) / PAGE_SIZE];
+	*ref = (ce->ce_flags & CMF_KMALLOC) ? ce->ce_owner : NULL;
+	return true;
+}
+
+/*
+ * Hit rate in percent, for printing.
+ */
+static
+unsigned
+cm_hitrate(unsigned hits, unsigned misses)
+{
+	if (hits + misses == 0) {
+		return 0;
+	}
+	return (hits * 100ULL) / (hits + misses);
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned order, nblocks[CM_NORDERS];
+	unsigned long nfree = 0;
+	struct pagecache *pc;
+	unsigned i;
+
+	/* Copy out under the lock; kprintf may block. */
+	spinlock_acquire(&cm_lock);
+	for (order=0; order<CM_NORDERS; order++) {
+		nblocks[order] = cm_nfree[order];
+	}
+	spinlock_release(&cm_lock);
+
+	kprintf("Coremap: %u frames at 0x%x\n", cm_nframes, cm_base);
+	for (order=0; order<CM_NORDERS; order++) {
+		if (nblocks[order] > 0) {
+			kprintf("    order %2u: %u free blocks\n",
+				order, nblocks[order]);
+		}
+		nfree += (unsigned long)nblocks[order] << order;
+	}
+	kprintf("    %lu frames free\n", nfree);
+
+	/* The per-cpu counters are only statistics; read them unlocked. */
+	for (i=0; i<cpu_count(); i++) {
+		pc = &cpu_get(i)->c_pagecache;
+		kprintf("    cpu%u: %2u cached, "
+			"alloc %u hits/%u misses (%u%%), "
+			"free %u hits/%u misses (%u%%)\n",
+			i, pc->pc_count,
+			pc->pc_allochits, pc->pc_allocmisses,
+			cm_hitrate(pc->pc_allochits, pc->pc_allocmisses),
+			pc->pc_freehits, pc->pc_freemisses,
+			cm_hitrate(pc->pc_freehits, pc->pc_freemisses));
+	}
+}
@@ -31,6 +31,20 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
+#if OPT_A3
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#include <kmalloc.h>
+#include <kmem_cache.h>
+#include <counter.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -75,6 +89,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    With OPT_A3 the table grows a page at a time with alloc_kpages,
+//    and each page's pageref is also recorded in the coremap, so
+//    kfree finds it without searching.
+//
 
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
@@ -138,6 +156,63 @@ struct pageref {
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
 
+#if OPT_A3
+/*
+ * The page in the BSS is only the first. When it runs out another
+ * page of pagerefs is taken from alloc_kpages, which never comes back
+ * here, so there is no bootstrap problem. Pagerefs not in use are
+ * kept on a list through next_samesize; pages of them are never
+ * given back.
+ */
+static struct pageref *freepagerefs;
+static unsigned npagerefs;	/* pagerefs in existence */
+static bool pagerefs_init;	/* the BSS page is on the free list */
+
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	npagerefs += n;
+}
+
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pageref *pr;
+
+	if (!pagerefs_init) {
+		addpagerefs(pagerefs, NPAGEREFS);
+		pagerefs_init = true;
+	}
+
+	pr = freepagerefs;
+	if (pr != NULL) {
+		freepagerefs = pr->next_samesize;
+	}
+	return pr;
+}
+
+static
+void
+freepageref(struct pageref *p)
+{
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+}
+
+#define MAXPAGEREFS npagerefs
+
+#else /* !OPT_A3 */
+
+#define MAXPAGEREFS NPAGEREFS
+
 #define INUSE_WORDS (NPAGEREFS/32)
 static uint32_t pagerefs_inuse[INUSE_WORDS];
 
@@ -181,6 +256,8 @@ freepageref(struct pageref *p)
 	pagerefs_inuse[i] &= ~k;
 }
 
+#endif /* OPT_A3 */
+
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
@@ -260,14 +337,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < MAXPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < MAXPAGEREFS);
 		ac++;
 	}
 
@@ -330,11 +407,21 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_A3
+static void kmags_printstats(void);
+static void lgblock_printstats(void);
+#endif
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
 
+#if OPT_A3
+	/* Show the blocks actually in use, not those cached for reuse. */
+	kmags_drain();
+#endif
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -345,6 +432,12 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_A3
+	kmags_printstats();
+	lgblock_printstats();
+	kmem_cache_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -392,6 +485,43 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take the first block off PR's free list.
+ */
+static
+void *
+subpage_pop(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -423,25 +553,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_pop(pr);
 
 			checksubpages();
 
@@ -468,7 +580,22 @@ subpage_kmalloc(size_t sz)
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
+#if OPT_A3
+	while ((pr = allocpageref()) == NULL) {
+		vaddr_t prs;
+
+		/* Another page of pagerefs; again, not under the lock. */
+		spinlock_release(&kmalloc_spinlock);
+		prs = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (prs == 0) {
+			break;
+		}
+		addpagerefs((struct pageref *)prs, NPAGEREFS);
+	}
+#else
 	pr = allocpageref();
+#endif
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -504,10 +631,49 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+#if OPT_A3
+	coremap_setkmref(KVADDR_TO_PADDR(prpage), pr);
+#endif
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the page PTRADDR is on. Returns NULL if it is
+ * not one of our pages.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+#if OPT_A3
+	void *ref;
+
+	/* Anything allocated since vm_bootstrap is in the coremap. */
+	if (coremap_getkmref(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME), &ref)) {
+		return ref;
+	}
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+	return pr;
+}
+
 static
 int
 subpage_kfree(void *ptr)
@@ -526,25 +692,18 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -578,6 +737,9 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_A3
+		coremap_setkmref(KVADDR_TO_PADDR(prpage), NULL);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -598,12 +760,580 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines in front of the subpage allocator. See kmalloc.h.
+
+#if OPT_A3
+
+#if NSIZES != KM_NSIZES
+#error "KM_NSIZES doesn't match the subpage allocator"
+#endif
+
+/* Batches the depot keeps per size before handing blocks back */
+#define KM_DEPOTMAX 8
+
+/*
+ * A batch in the depot is KM_BATCH free blocks chained through their
+ * first word; the first block of each links the batches with its
+ * second. The smallest block has room for both.
+ */
+struct kmbatch {
+	struct kmbatch *kb_nextobj;
+	struct kmbatch *kb_nextbatch;
+};
+
+static struct spinlock depot_lock = SPINLOCK_INITIALIZER;
+static struct kmbatch *depot[NSIZES];
+static unsigned depot_nbatches[NSIZES];
+
+static bool kmags_ready;
+
+void
+kmalloc_bootstrap(void)
+{
+	kmags_ready = true;
+}
+
+void
+kmags_init(struct kmags *km)
+{
+	unsigned i;
+
+	for (i=0; i<KM_NSIZES; i++) {
+		km->km_count[i] = 0;
+	}
+}
+
+/*
+ * Take up to N blocks of type BLKTYPE that are free on pages the
+ * subpage allocator already has. Never allocates a page, so it is
+ * safe with interrupts off. Returns the number found.
+ */
+static
+unsigned
+subpage_takeblocks(unsigned blktype, void **objs, unsigned n)
+{
+	struct pageref *pr;
+	unsigned got = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		while (pr->nfree > 0 && got < n) {
+			objs[got++] = subpage_pop(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Refill the empty magazine for BLKTYPE from the depot, or failing
+ * that from the subpage allocator.
+ */
+static
+void
+kmags_refill(struct kmags *km, unsigned blktype)
+{
+	struct kmbatch *kb;
+	unsigned n;
+
+	KASSERT(km->km_count[blktype] == 0);
+
+	spinlock_acquire(&depot_lock);
+	kb = depot[blktype];
+	if (kb != NULL) {
+		depot[blktype] = kb->kb_nextbatch;
+		depot_nbatches[blktype]--;
+	}
+	spinlock_release(&depot_lock);
+
+	if (kb == NULL) {
+		km->km_count[blktype] =
+			subpage_takeblocks(blktype, km->km_objs[blktype],
+					   KM_BATCH);
+		return;
+	}
+
+	for (n = 0; kb != NULL; n++) {
+		KASSERT(n < KM_MAGSIZE);
+		km->km_objs[blktype][n] = kb;
+		kb = kb->kb_nextobj;
+	}
+	km->km_count[blktype] = n;
+}
+
+/*
+ * Move the KM_BATCH oldest blocks out of the full magazine for
+ * BLKTYPE into the depot. If the depot is full too, the batch is
+ * returned instead, for the caller to give back to the subpage
+ * allocator once interrupts are on again.
+ */
+static
+struct kmbatch *
+kmags_unload(struct kmags *km, unsigned blktype)
+{
+	void **objs = km->km_objs[blktype];
+	struct kmbatch *kb, *obj;
+	unsigned i;
+
+	KASSERT(km->km_count[blktype] >= KM_BATCH);
+
+	kb = NULL;
+	for (i = KM_BATCH; i-- > 0; ) {
+		obj = objs[i];
+		obj->kb_nextobj = kb;
+		kb = obj;
+	}
+	for (i = KM_BATCH; i < km->km_count[blktype]; i++) {
+		objs[i - KM_BATCH] = objs[i];
+	}
+	km->km_count[blktype] -= KM_BATCH;
+
+	spinlock_acquire(&depot_lock);
+	if (depot_nbatches[blktype] < KM_DEPOTMAX) {
+		kb->kb_nextbatch = depot[blktype];
+		depot[blktype] = kb;
+		depot_nbatches[blktype]++;
+		kb = NULL;
+	}
+	spinlock_release(&depot_lock);
+
+	return kb;
+}
+
+static
+void *
+kmags_alloc(size_t sz)
+{
+	struct kmags *km;
+	unsigned blktype;
+	void *ptr;
+	int spl;
+
+	blktype = blocktype(sz);
+
+	/* Stay on this cpu while we use its magazines. */
+	spl = splhigh();
+	km = &curcpu->c_kmags;
+	if (km->km_count[blktype] > 0) {
+		_counter_inc(CNT_KM_ALLOCHIT);
+	}
+	else {
+		_counter_inc(CNT_KM_ALLOCMISS);
+		kmags_refill(km, blktype);
+	}
+	ptr = NULL;
+	if (km->km_count[blktype] > 0) {
+		ptr = km->km_objs[blktype][--km->km_count[blktype]];
+	}
+	splx(spl);
+
+	/* NULL sends the caller to subpage_kmalloc for a new page. */
+	return ptr;
+}
+
+/*
+ * Put a small block in this cpu's magazine. Returns false if PTR is
+ * not a small block we can place: a large allocation, or one on a
+ * page from before the coremap existed.
+ */
+static
+bool
+kmags_free(void *ptr)
+{
+	struct kmags *km;
+	struct pageref *pr;
+	struct kmbatch *kb, *next;
+	unsigned blktype, i;
+	void *ref;
+	int spl;
+
+	if (!coremap_getkmref(KVADDR_TO_PADDR((vaddr_t)ptr & PAGE_FRAME),
+			      &ref) || ref == NULL) {
+		return false;
+	}
+
+	/* The page's pageref can't change while one of its blocks is out. */
+	pr = ref;
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	KASSERT(PR_PAGEADDR(pr) == ((vaddr_t)ptr & PAGE_FRAME));
+	if (((vaddr_t)ptr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	/*
+	 * With this block out the page can't be all free; if it is,
+	 * the block was freed before.
+	 */
+	KASSERT(pr->nfree < PAGE_SIZE / sizes[blktype]);
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	kb = NULL;
+	spl = splhigh();
+	km = &curcpu->c_kmags;
+	for (i=0; i<km->km_count[blktype]; i++) {
+		if (km->km_objs[blktype][i] == ptr) {
+			panic("kfree: free of free block %p\n", ptr);
+		}
+	}
+	if (km->km_count[blktype] < KM_MAGSIZE) {
+		_counter_inc(CNT_KM_FREEHIT);
+	}
+	else {
+		_counter_inc(CNT_KM_FREEMISS);
+		kb = kmags_unload(km, blktype);
+	}
+	km->km_objs[blktype][km->km_count[blktype]++] = ptr;
+	splx(spl);
+
+	for (; kb != NULL; kb = next) {
+		next = kb->kb_nextobj;
+		subpage_kfree(kb);
+	}
+	return true;
+}
+
+unsigned
+kmags_drain(void)
+{
+	struct kmags *km;
+	struct kmbatch *batch, *nextbatch, *kb, *next, *list;
+	unsigned i, j, n;
+	int spl;
+
+	if (!kmags_ready) {
+		return 0;
+	}
+
+	/* Chain everything together through the first word. */
+	list = NULL;
+	spinlock_acquire(&depot_lock);
+	for (i=0; i<NSIZES; i++) {
+		for (batch = depot[i]; batch != NULL; batch = nextbatch) {
+			nextbatch = batch->kb_nextbatch;
+			for (kb = batch; kb != NULL; kb = next) {
+				next = kb->kb_nextobj;
+				kb->kb_nextobj = list;
+				list = kb;
+			}
+		}
+		depot[i] = NULL;
+		depot_nbatches[i] = 0;
+	}
+	spinlock_release(&depot_lock);
+
+	/* Other cpus' magazines are theirs alone. */
+	spl = splhigh();
+	km = &curcpu->c_kmags;
+	for (i=0; i<KM_NSIZES; i++) {
+		for (j=0; j<km->km_count[i]; j++) {
+			kb = km->km_objs[i][j];
+			kb->kb_nextobj = list;
+			list = kb;
+		}
+		km->km_count[i] = 0;
+	}
+	splx(spl);
+
+	n = 0;
+	for (kb = list; kb != NULL; kb = next) {
+		next = kb->kb_nextobj;
+		subpage_kfree(kb);
+		n++;
+	}
+	return n;
+}
+
+static
+void
+kmags_printstats(void)
+{
+	struct kmags *km;
+	unsigned i, j, n;
+
+	kprintf("Depot:");
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %lu:%u", (unsigned long)sizes[i],
+			depot_nbatches[i] * KM_BATCH);
+	}
+	kprintf("\n");
+
+	/* Only statistics; read them unlocked. */
+	for (i=0; i<cpu_count(); i++) {
+		km = &cpu_get(i)->c_kmags;
+		n = 0;
+		for (j=0; j<KM_NSIZES; j++) {
+			n += km->km_count[j];
+		}
+		kprintf("cpu%u: %u blocks in magazines\n", i, n);
+	}
+	kprintf("Magazines: alloc %u hits/%u misses, "
+		"free %u hits/%u misses\n",
+		counter_read(CNT_KM_ALLOCHIT), counter_read(CNT_KM_ALLOCMISS),
+		counter_read(CNT_KM_FREEHIT), counter_read(CNT_KM_FREEMISS));
+}
+
+#endif /* OPT_A3 */
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Large blocks.
+//
+// Requests over LARGEST_SUBPAGE_SIZE otherwise get whole pages, which
+// wastes up to most of a page on an odd size. Those that fit one of
+// the classes in lgsizes[] with less waste are instead carved out of
+// chunks of LG_CHUNKPAGES contiguous pages, which each class divides
+// evenly: four 3k blocks or two 6k blocks to a chunk. Physically
+// contiguous pages can run out long before memory does, and only
+// single pages can be had by evicting, so if there's no such run a
+// chunk is made as small as one block allows instead: a single page
+// for 3k (wasting what a whole page would) or two for 6k. Every page
+// of a chunk records the chunk's header in the coremap, tagged with
+// KMREF_LARGE so it can't be taken for a pageref; that's how kfree
+// finds it. Free blocks in a chunk are chained through their first
+// word. A chunk that becomes entirely free is handed back, unless
+// it's the only one of its class with free blocks.
+
+#if OPT_A3
+
+#define LG_NCLASSES	2
+#define LG_CHUNKPAGES	3
+static const size_t lgsizes[LG_NCLASSES] = { 3072, 6144 };
+
+#define KMREF_LARGE	0x1
+
+struct lgchunk {
+	struct lgchunk *lc_next;	/* next chunk with free blocks */
+	vaddr_t lc_base;		/* first page */
+	unsigned lc_npages;		/* LG_CHUNKPAGES, or fewer */
+	unsigned lc_class;		/* index into lgsizes[] */
+	unsigned lc_nblocks;		/* blocks in the chunk */
+	unsigned lc_nfree;		/* free blocks */
+	void *lc_freelist;
+};
+
+/* lg_lock protects the following. */
+static struct spinlock lg_lock = SPINLOCK_INITIALIZER;
+static struct lgchunk *lg_partial[LG_NCLASSES];	/* chunks with free blocks */
+static unsigned lg_nchunks[LG_NCLASSES];
+
+/*
+ * Pick the class for a request of SZ bytes, or -1 if whole pages
+ * would do as well.
+ */
+static
+int
+lgblock_class(size_t sz)
+{
+	int i;
+
+	for (i=0; i<LG_NCLASSES; i++) {
+		if (sz <= lgsizes[i]) {
+			if (lgsizes[i] >= ROUNDUP(sz, PAGE_SIZE)) {
+				return -1;
+			}
+			return i;
+		}
+	}
+	return -1;
+}
+
+static
+void
+lgchunk_tag(struct lgchunk *lc, bool set)
+{
+	void *ref;
+	unsigned i;
+
+	ref = set ? (void *)((uintptr_t)lc | KMREF_LARGE) : NULL;
+	for (i=0; i<lc->lc_npages; i++) {
+		coremap_setkmref(KVADDR_TO_PADDR(lc->lc_base + i*PAGE_SIZE),
+				 ref);
+	}
+}
+
+/*
+ * Make a new chunk of the given class, with all its blocks free.
+ */
+static
+struct lgchunk *
+lgchunk_create(unsigned class)
+{
+	struct lgchunk *lc;
+	unsigned i, n;
+	char *blk;
+
+	lc = kmalloc(sizeof(*lc));
+	if (lc == NULL) {
+		return NULL;
+	}
+	lc->lc_npages = LG_CHUNKPAGES;
+	lc->lc_base = alloc_kpages(lc->lc_npages);
+	if (lc->lc_base == 0) {
+		/* No contiguous run; make do with room for one block. */
+		lc->lc_npages = DIVROUNDUP(lgsizes[class], PAGE_SIZE);
+		lc->lc_base = alloc_kpages(lc->lc_npages);
+		if (lc->lc_base == 0) {
+			kfree(lc);
+			return NULL;
+		}
+	}
+	lc->lc_next = NULL;
+	lc->lc_class = class;
+
+	n = lc->lc_npages * PAGE_SIZE / lgsizes[class];
+	KASSERT(n > 0);
+	lc->lc_nblocks = n;
+	lc->lc_freelist = NULL;
+	for (i=n; i-- > 0; ) {
+		blk = (char *)lc->lc_base + i * lgsizes[class];
+		*(void **)blk = lc->lc_freelist;
+		lc->lc_freelist = blk;
+	}
+	lc->lc_nfree = n;
+
+	lgchunk_tag(lc, true);
+	return lc;
+}
+
+static
+void *
+lgblock_alloc(unsigned class)
+{
+	struct lgchunk *lc;
+	void *ptr;
+
+	spinlock_acquire(&lg_lock);
+	if (lg_partial[class] == NULL) {
+		spinlock_release(&lg_lock);
+		lc = lgchunk_create(class);
+		if (lc == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&lg_lock);
+		lc->lc_next = lg_partial[class];
+		lg_partial[class] = lc;
+		lg_nchunks[class]++;
+	}
+
+	lc = lg_partial[class];
+	KASSERT(lc->lc_nfree > 0);
+	ptr = lc->lc_freelist;
+	lc->lc_freelist = *(void **)ptr;
+	lc->lc_nfree--;
+	if (lc->lc_nfree == 0) {
+		lg_partial[class] = lc->lc_next;
+		lc->lc_next = NULL;
+	}
+	spinlock_release(&lg_lock);
+
+	return ptr;
+}
+
+/*
+ * Free a large block. Returns false if PTR isn't one.
+ */
+static
+bool
+lgblock_free(void *ptr)
+{
+	struct lgchunk *lc, **lcp;
+	unsigned class;
+	void *ref;
+
+	if (!coremap_getkmref(KVADDR_TO_PADDR((vaddr_t)ptr & PAGE_FRAME),
+			      &ref) ||
+	    ((uintptr_t)ref & KMREF_LARGE) == 0) {
+		return false;
+	}
+
+	lc = (struct lgchunk *)((uintptr_t)ref & ~(uintptr_t)KMREF_LARGE);
+	class = lc->lc_class;
+	KASSERT(class < LG_NCLASSES);
+	if (((vaddr_t)ptr - lc->lc_base) % lgsizes[class] != 0) {
+		panic("kfree: large free of invalid addr %p\n", ptr);
+	}
+	fill_deadbeef(ptr, lgsizes[class]);
+
+	spinlock_acquire(&lg_lock);
+	*(void **)ptr = lc->lc_freelist;
+	lc->lc_freelist = ptr;
+	if (lc->lc_nfree++ == 0) {
+		lc->lc_next = lg_partial[class];
+		lg_partial[class] = lc;
+	}
+
+	if (lc->lc_nfree < lc->lc_nblocks ||
+	    (lg_partial[class] == lc && lc->lc_next == NULL)) {
+		spinlock_release(&lg_lock);
+		return true;
+	}
+
+	/* Entirely free, and not the last chunk with room: let it go. */
+	for (lcp = &lg_partial[class]; *lcp != lc; lcp = &(*lcp)->lc_next) {
+		KASSERT(*lcp != NULL);
+	}
+	*lcp = lc->lc_next;
+	lg_nchunks[class]--;
+	spinlock_release(&lg_lock);
+
+	lgchunk_tag(lc, false);
+	free_kpages(lc->lc_base);
+	kfree(lc);
+	return true;
+}
+
+static
+void
+lgblock_printstats(void)
+{
+	unsigned i;
+
+	kprintf("Large blocks:");
+	for (i=0; i<LG_NCLASSES; i++) {
+		kprintf(" %lu: %u chunks", (unsigned long)lgsizes[i],
+			lg_nchunks[i]);
+	}
+	kprintf("\n");
+}
+
+#endif /* OPT_A3 */
+
+//
+////////////////////////////////////////////////////////////
+
+#if OPT_KMPROF
+/* kmalloc and kfree proper; the exported ones below record sites. */
+static
+void *
+dokmalloc(size_t sz)
+#else
 void *
 kmalloc(size_t sz)
+#endif
 {
+#if OPT_A3
+	/* A 2048-byte request fits the largest subpage block. */
+	if (sz>LARGEST_SUBPAGE_SIZE) {
+#else
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
+#endif
 		unsigned long npages;
 		vaddr_t address;
+#if OPT_A3
+		int class;
+
+		/* Large blocks need the coremap to find them again. */
+		class = lgblock_class(sz);
+		if (kmags_ready && class >= 0) {
+			return lgblock_alloc(class);
+		}
+#endif
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
@@ -615,20 +1345,67 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#if OPT_A3
+	if (kmags_ready) {
+		void *ptr = kmags_alloc(sz);
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
 	return subpage_kmalloc(sz);
 }
 
+#if OPT_KMPROF
+static
+void
+dokfree(void *ptr)
+#else
 void
 kfree(void *ptr)
+#endif
 {
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_A3
+	else if (kmags_ready && lgblock_free(ptr)) {
+		return;
+	}
+	else if (kmags_ready && kmags_free(ptr)) {
+		return;
+	}
+#endif
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
 
+#if OPT_KMPROF
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	ptr = dokmalloc(sz);
+	if (ptr != NULL) {
+		kmprof_alloc(ptr, sz,
+			     (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
+}
+
+void
+kfree(void *ptr)
+{
+	if (ptr != NULL) {
+		/* Before the block can be handed out again */
+		kmprof_free(ptr);
+	}
+	dokfree(ptr);
+}
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Object caches. See kmem_cache.h for the overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * Each object in a slab is followed by a bufctl, which links it into
+ * its slab's free list and finds the slab again when it is freed.
+ * The slab header sits at the start of the slab's first page, with
+ * the objects after it.
+ */
+struct kmbufctl {
+	struct kmbufctl *bc_next;	/* next free object in the slab */
+	struct kmslab *bc_slab;		/* slab the object is in */
+	bool bc_constructed;		/* ctor has run on the object */
+};
+
+struct kmslab {
+	struct kmslab *ks_next;		/* partial list */
+	struct kmslab *ks_prev;
+	struct kmem_cache *ks_cache;
+	struct kmbufctl *ks_free;	/* free objects */
+	unsigned ks_nfree;
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, as asked for */
+	size_t kc_bufsize;		/* object and bufctl, aligned */
+	unsigned kc_slabpages;		/* pages per slab */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kmem_cache *kc_next;	/* all caches */
+
+	/* kc_lock protects the following. */
+	struct spinlock kc_lock;
+	struct kmslab *kc_partial;	/* slabs with free objects */
+	unsigned kc_nslabs;
+	unsigned kc_nfree;		/* free objects in all slabs */
+	unsigned kc_nalloc;		/* statistics */
+	unsigned kc_nctor;
+};
+
+#define KC_ALIGN	8	/* object alignment */
+#define KC_MAXSLABPAGES	8	/* largest slab */
+
+#define KC_BUFCTL(kc, obj) \
+	((struct kmbufctl *)((char *)(obj) + ROUNDUP((kc)->kc_size, KC_ALIGN)))
+#define KC_OBJ(kc, bc) \
+	((void *)((char *)(bc) - ROUNDUP((kc)->kc_size, KC_ALIGN)))
+
+static struct spinlock kc_listlock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kc_all;
+
+#define KC_MAXPRINT	32	/* most kmem_cache_printstats will show */
+
+/* kmem_cache_printstats's copy of the numbers; one print at a time. */
+static struct kc_stats {
+	const char *st_name;
+	size_t st_size;
+	unsigned st_perslab;
+	unsigned st_slabpages;
+	unsigned st_nslabs;
+	unsigned st_inuse;
+	unsigned st_nalloc;
+	unsigned st_nctor;
+} kc_stats[KC_MAXPRINT];
+
+/*
+ * Pick the smallest slab that wastes no more than an eighth of its
+ * space, or the largest we allow.
+ */
+static
+void
+kc_sizeslab(struct kmem_cache *kc)
+{
+	unsigned npages, n;
+	size_t space, waste;
+
+	for (npages = 1; ; npages++) {
+		space = npages * PAGE_SIZE -
+			ROUNDUP(sizeof(struct kmslab), KC_ALIGN);
+		n = space / kc->kc_bufsize;
+		waste = space - n * kc->kc_bufsize;
+		if (n > 0 && waste * 8 <= npages * PAGE_SIZE) {
+			break;
+		}
+		if (npages == KC_MAXSLABPAGES) {
+			break;
+		}
+	}
+	KASSERT(n > 0);
+	kc->kc_slabpages = npages;
+	kc->kc_perslab = n;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_bufsize = ROUNDUP(size, KC_ALIGN) +
+		ROUNDUP(sizeof(struct kmbufctl), KC_ALIGN);
+	kc_sizeslab(kc);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nfree = 0;
+	kc->kc_nalloc = 0;
+	kc->kc_nctor = 0;
+
+	spinlock_acquire(&kc_listlock);
+	kc->kc_next = kc_all;
+	kc_all = kc;
+	spinlock_release(&kc_listlock);
+
+	return kc;
+}
+
+/*
+ * Partial list handling. Call with kc_lock held.
+ */
+static
+void
+kc_addpartial(struct kmem_cache *kc, struct kmslab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_partial;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks;
+	}
+	kc->kc_partial = ks;
+}
+
+static
+void
+kc_rempartial(struct kmem_cache *kc, struct kmslab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(kc->kc_partial == ks);
+		kc->kc_partial = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Get a new slab and put all its objects, unconstructed, on its free
+ * list. Returns false if out of memory.
+ */
+static
+bool
+kc_grow(struct kmem_cache *kc)
+{
+	struct kmslab *ks;
+	struct kmbufctl *bc;
+	char *obj;
+	unsigned i;
+
+	ks = (struct kmslab *)alloc_kpages(kc->kc_slabpages);
+	if (ks == NULL) {
+		return false;
+	}
+	ks->ks_cache = kc;
+	ks->ks_free = NULL;
+	ks->ks_nfree = kc->kc_perslab;
+
+	/* Build the free list backwards so objects go out in order. */
+	obj = (char *)ks + ROUNDUP(sizeof(*ks), KC_ALIGN) +
+		kc->kc_perslab * kc->kc_bufsize;
+	for (i=0; i<kc->kc_perslab; i++) {
+		obj -= kc->kc_bufsize;
+		bc = KC_BUFCTL(kc, obj);
+		bc->bc_slab = ks;
+		bc->bc_constructed = false;
+		bc->bc_next = ks->ks_free;
+		ks->ks_free = bc;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc_addpartial(kc, ks);
+	kc->kc_nslabs++;
+	kc->kc_nfree += kc->kc_perslab;
+	spinlock_release(&kc->kc_lock);
+	return true;
+}
+
+/*
+ * Destruct the objects in a slab that is no longer on any list and
+ * give its pages back.
+ */
+static
+void
+kc_reap(struct kmem_cache *kc, struct kmslab *ks)
+{
+	struct kmbufctl *bc;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+
+	for (bc = ks->ks_free; bc != NULL; bc = bc->bc_next) {
+		if (bc->bc_constructed && kc->kc_dtor != NULL) {
+			kc->kc_dtor(KC_OBJ(kc, bc));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmslab *ks;
+	struct kmbufctl *bc;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL) {
+		spinlock_release(&kc->kc_lock);
+		if (!kc_grow(kc)) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+	}
+
+	ks = kc->kc_partial;
+	KASSERT(ks->ks_nfree > 0);
+	bc = ks->ks_free;
+	ks->ks_free = bc->bc_next;
+	ks->ks_nfree--;
+	kc->kc_nfree--;
+	if (ks->ks_nfree == 0) {
+		kc_rempartial(kc, ks);
+	}
+	kc->kc_nalloc++;
+	spinlock_release(&kc->kc_lock);
+
+	bc->bc_next = NULL;
+	obj = KC_OBJ(kc, bc);
+
+	/* Construct on first use, since the constructor may allocate. */
+	if (!bc->bc_constructed) {
+		if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+			/* Still unconstructed; the free path copes. */
+			kmem_cache_free(kc, obj);
+			return NULL;
+		}
+		bc->bc_constructed = true;
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nctor++;
+		spinlock_release(&kc->kc_lock);
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmbufctl *bc;
+	struct kmslab *ks;
+
+	KASSERT(obj != NULL);
+	bc = KC_BUFCTL(kc, obj);
+	ks = bc->bc_slab;
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(bc->bc_next == NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	bc->bc_next = ks->ks_free;
+	ks->ks_free = bc;
+	if (ks->ks_nfree++ == 0) {
+		kc_addpartial(kc, ks);
+	}
+	kc->kc_nfree++;
+
+	/*
+	 * Give an empty slab back only if there's another slab's worth
+	 * of free objects besides it, so a cache hovering around a slab
+	 * boundary doesn't keep making and destroying one.
+	 */
+	if (ks->ks_nfree == kc->kc_perslab &&
+	    kc->kc_nfree >= 2 * kc->kc_perslab) {
+		kc_rempartial(kc, ks);
+		kc->kc_nslabs--;
+		kc->kc_nfree -= kc->kc_perslab;
+		spinlock_release(&kc->kc_lock);
+		kc_reap(kc, ks);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmslab *ks;
+
+	spinlock_acquire(&kc_listlock);
+	for (p = &kc_all; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kc_listlock);
+
+	/* Nobody else can be using it, so no locking. */
+	KASSERT(kc->kc_nfree == kc->kc_nslabs * kc->kc_perslab);
+	while ((ks = kc->kc_partial) != NULL) {
+		kc_rempartial(kc, ks);
+		kc_reap(kc, ks);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	struct kc_stats *st;
+	unsigned i, n, more;
+
+	/*
+	 * kprintf under a spinlock prints polled with interrupts off,
+	 * holding up every cache create and destroy meanwhile, so copy
+	 * the numbers out and print after letting go of kc_listlock.
+	 * The list lock keeps each cache from going away while we look;
+	 * the counters are only statistics, so we don't take kc_lock.
+	 */
+	n = more = 0;
+	spinlock_acquire(&kc_listlock);
+	for (kc = kc_all; kc != NULL; kc = kc->kc_next) {
+		if (n == KC_MAXPRINT) {
+			more++;
+			continue;
+		}
+		st = &kc_stats[n++];
+		st->st_name = kc->kc_name;
+		st->st_size = kc->kc_size;
+		st->st_perslab = kc->kc_perslab;
+		st->st_slabpages = kc->kc_slabpages;
+		st->st_nslabs = kc->kc_nslabs;
+		st->st_inuse = kc->kc_nslabs * kc->kc_perslab - kc->kc_nfree;
+		st->st_nalloc = kc->kc_nalloc;
+		st->st_nctor = kc->kc_nctor;
+	}
+	spinlock_release(&kc_listlock);
+
+	kprintf("Object caches:\n");
+	for (i=0; i<n; i++) {
+		st = &kc_stats[i];
+		kprintf("  %-12s %4lu bytes, %u/slab of %u pages, "
+			"%u slabs, %u in use, %u allocs, %u ctors\n",
+			st->st_name, (unsigned long)st->st_size,
+			st->st_perslab, st->st_slabpages, st->st_nslabs,
+			st->st_inuse, st->st_nalloc, st->st_nctor);
+	}
+	if (more > 0) {
+		kprintf("  (%u more)\n", more);
+	}
+}
@@ -0,0 +1,317 @@
+/*
+ * kmalloc allocation-site profiler. See kmprof.h for the overview.
+ *
+ * Both tables are fixed arrays, so the profiler never allocates
+ * memory itself. Live blocks are kept in an open-addressed hash table
+ * keyed by address; call sites in another, keyed by return address.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <kmprof.h>
+
+#define KMPROF_NRECS	8192	/* live blocks tracked; a power of 2 */
+#define KMPROF_NSITES	512	/* call sites tracked; a power of 2 */
+#define KMPROF_MAXPRINT	32	/* most kmprof_print will show */
+
+/* Where sites go once the site table is full */
+#define KMPROF_OTHER	0
+
+struct kmprof_rec {
+	vaddr_t kr_ptr;			/* block, or 0 if slot unused */
+	uint32_t kr_size;
+	uint16_t kr_site;		/* index into kmprof_sites[] */
+};
+
+struct kmprof_site {
+	vaddr_t ks_pc;			/* caller, or 0 if slot unused */
+	unsigned ks_liveblocks;
+	size_t ks_livebytes;
+	unsigned ks_nallocs;		/* allocations ever */
+
+	/* As of the last mark */
+	size_t ks_markbytes;
+	unsigned ks_markallocs;
+};
+
+/* kmprof_lock protects everything below. */
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+static struct kmprof_rec kmprof_recs[KMPROF_NRECS];
+static struct kmprof_site kmprof_sites[KMPROF_NSITES];
+static unsigned kmprof_nrecs;		/* slots in use in kmprof_recs */
+static unsigned kmprof_dropped;		/* allocations not tracked */
+static bool kmprof_marked;
+static time_t kmprof_marksecs;
+static uint32_t kmprof_marknsecs;
+static bool kmprof_picked[KMPROF_NSITES];	/* for kmprof_print */
+
+/* kmprof_print's copy of the top sites; only one print at a time. */
+static struct kmprof_top {
+	struct kmprof_site kt_site;
+	bool kt_other;			/* it's KMPROF_OTHER */
+	uint32_t kt_value;		/* by the measure asked for */
+} kmprof_top[KMPROF_MAXPRINT];
+
+static
+unsigned
+kmprof_hash(vaddr_t v)
+{
+	/* Fibonacci hashing; blocks are at least 16-byte aligned. */
+	return ((v >> 4) * 2654435761U) >> 12;
+}
+
+/*
+ * Find or make the site for CALLER.
+ */
+static
+unsigned
+kmprof_site(vaddr_t caller)
+{
+	unsigned i, n;
+
+	KASSERT(caller != 0);
+
+	i = kmprof_hash(caller) % KMPROF_NSITES;
+	for (n = 0; n < KMPROF_NSITES; n++, i = (i + 1) % KMPROF_NSITES) {
+		if (i == KMPROF_OTHER) {
+			continue;
+		}
+		if (kmprof_sites[i].ks_pc == caller) {
+			return i;
+		}
+		if (kmprof_sites[i].ks_pc == 0) {
+			kmprof_sites[i].ks_pc = caller;
+			return i;
+		}
+	}
+	return KMPROF_OTHER;
+}
+
+void
+kmprof_alloc(void *ptr, size_t size, vaddr_t caller)
+{
+	struct kmprof_site *ks;
+	unsigned i, site;
+
+	spinlock_acquire(&kmprof_lock);
+
+	site = kmprof_site(caller);
+	ks = &kmprof_sites[site];
+	ks->ks_nallocs++;
+
+	/* Keep the table at most 3/4 full so probes stay short. */
+	if (kmprof_nrecs >= KMPROF_NRECS / 4 * 3) {
+		kmprof_dropped++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	i = kmprof_hash((vaddr_t)ptr) % KMPROF_NRECS;
+	while (kmprof_recs[i].kr_ptr != 0) {
+		KASSERT(kmprof_recs[i].kr_ptr != (vaddr_t)ptr);
+		i = (i + 1) % KMPROF_NRECS;
+	}
+	kmprof_recs[i].kr_ptr = (vaddr_t)ptr;
+	kmprof_recs[i].kr_size = size;
+	kmprof_recs[i].kr_site = site;
+	kmprof_nrecs++;
+
+	ks->ks_liveblocks++;
+	ks->ks_livebytes += size;
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_site *ks;
+	unsigned i, j, k;
+
+	spinlock_acquire(&kmprof_lock);
+
+	i = kmprof_hash((vaddr_t)ptr) % KMPROF_NRECS;
+	while (kmprof_recs[i].kr_ptr != (vaddr_t)ptr) {
+		if (kmprof_recs[i].kr_ptr == 0) {
+			/* Allocated while the table was full */
+			spinlock_release(&kmprof_lock);
+			return;
+		}
+		i = (i + 1) % KMPROF_NRECS;
+	}
+
+	ks = &kmprof_sites[kmprof_recs[i].kr_site];
+	KASSERT(ks->ks_liveblocks > 0);
+	ks->ks_liveblocks--;
+	ks->ks_livebytes -= kmprof_recs[i].kr_size;
+	kmprof_nrecs--;
+
+	/*
+	 * Close the gap: move back any later entry in the run that
+	 * hashes at or before the hole, so lookups never stop short.
+	 */
+	j = i;
+	for (;;) {
+		j = (j + 1) % KMPROF_NRECS;
+		if (kmprof_recs[j].kr_ptr == 0) {
+			break;
+		}
+		k = kmprof_hash(kmprof_recs[j].kr_ptr) % KMPROF_NRECS;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			kmprof_recs[i] = kmprof_recs[j];
+			i = j;
+		}
+	}
+	kmprof_recs[i].kr_ptr = 0;
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_mark(void)
+{
+	struct kmprof_site *ks;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+
+	gettime(&secs, &nsecs);
+
+	spinlock_acquire(&kmprof_lock);
+	for (i=0; i<KMPROF_NSITES; i++) {
+		ks = &kmprof_sites[i];
+		ks->ks_markbytes = ks->ks_livebytes;
+		ks->ks_markallocs = ks->ks_nallocs;
+	}
+	kmprof_marked = true;
+	kmprof_marksecs = secs;
+	kmprof_marknsecs = nsecs;
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * The measure HOW for a site, or 0 if the site shouldn't be listed.
+ */
+static
+uint32_t
+kmprof_value(const struct kmprof_site *ks, int how)
+{
+	switch (how) {
+	    case KMPROF_LIVE:
+		return ks->ks_livebytes;
+	    case KMPROF_RATE:
+		return ks->ks_nallocs - ks->ks_markallocs;
+	    case KMPROF_DIFF:
+		if (ks->ks_livebytes <= ks->ks_markbytes) {
+			return 0;
+		}
+		return ks->ks_livebytes - ks->ks_markbytes;
+	}
+	panic("kmprof: bad measure %d\n", how);
+	return 0;
+}
+
+void
+kmprof_print(int how, unsigned n)
+{
+	struct kmprof_site *ks;
+	struct kmprof_top *kt;
+	time_t secs, esecs;
+	uint32_t nsecs, ensecs, v, best;
+	unsigned i, j, pick, total, nrecs, dropped;
+
+	KASSERT(how == KMPROF_LIVE || how == KMPROF_RATE ||
+		how == KMPROF_DIFF);
+
+	if (n > KMPROF_MAXPRINT) {
+		n = KMPROF_MAXPRINT;
+	}
+
+	gettime(&secs, &nsecs);
+
+	/*
+	 * kprintf can take locks and allocate memory, which would come
+	 * back to us, so copy the top sites out and print afterwards.
+	 */
+	spinlock_acquire(&kmprof_lock);
+
+	if (how != KMPROF_LIVE && !kmprof_marked) {
+		spinlock_release(&kmprof_lock);
+		kprintf("kmprof: no mark set\n");
+		return;
+	}
+	esecs = 0;
+	if (kmprof_marked) {
+		getinterval(kmprof_marksecs, kmprof_marknsecs, secs, nsecs,
+			    &esecs, &ensecs);
+	}
+
+	total = 0;
+	for (i=0; i<KMPROF_NSITES; i++) {
+		total += kmprof_sites[i].ks_livebytes;
+		kmprof_picked[i] = false;
+	}
+	nrecs = kmprof_nrecs;
+	dropped = kmprof_dropped;
+
+	/* Selection; there are few sites and N is small. */
+	for (j=0; j<n; j++) {
+		pick = KMPROF_NSITES;
+		best = 0;
+		for (i=0; i<KMPROF_NSITES; i++) {
+			ks = &kmprof_sites[i];
+			if (kmprof_picked[i] ||
+			    (ks->ks_pc == 0 && i != KMPROF_OTHER)) {
+				continue;
+			}
+			v = kmprof_value(ks, how);
+			if (v > best) {
+				best = v;
+				pick = i;
+			}
+		}
+		if (pick == KMPROF_NSITES) {
+			break;
+		}
+		kmprof_picked[pick] = true;
+		kmprof_top[j].kt_site = kmprof_sites[pick];
+		kmprof_top[j].kt_other = pick == KMPROF_OTHER;
+		kmprof_top[j].kt_value = best;
+	}
+
+	spinlock_release(&kmprof_lock);
+
+	kprintf("kmprof: %u live blocks, %u bytes, %u untracked allocs\n",
+		nrecs, total, dropped);
+	if (how == KMPROF_RATE) {
+		kprintf("kmprof: %lu seconds since mark\n",
+			(unsigned long)esecs);
+	}
+	kprintf("  caller      live blocks  live bytes  since mark  "
+		"%s\n", how == KMPROF_RATE ? "allocs/sec" :
+		how == KMPROF_DIFF ? "bytes grown" : "allocs");
+
+	n = j;
+	for (j=0; j<n; j++) {
+		kt = &kmprof_top[j];
+		ks = &kt->kt_site;
+		best = kt->kt_value;
+
+		if (kt->kt_other) {
+			kprintf("  (other)   ");
+		}
+		else {
+			kprintf("  0x%08x", ks->ks_pc);
+		}
+		kprintf(" %11u %11lu %11u %11lu\n",
+			ks->ks_liveblocks, (unsigned long)ks->ks_livebytes,
+			ks->ks_nallocs - ks->ks_markallocs,
+			how == KMPROF_LIVE ? (unsigned long)ks->ks_nallocs :
+			how == KMPROF_RATE ?
+			(unsigned long)(esecs > 0 ? best / esecs : best) :
+			(unsigned long)best);
+	}
+}
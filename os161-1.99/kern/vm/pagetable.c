@@ -0,0 +1,163 @@
+/*
+ * Two-level page tables. See pagetable.h for the overview.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+
+#define PT_L2SHIFT	22			/* bits below the directory index */
+#define PT_NL1		(USERSPACETOP >> PT_L2SHIFT)
+#define PT_NL2		(PAGE_SIZE / sizeof(pte_t))
+
+#define PT_L1INDEX(va)	((va) >> PT_L2SHIFT)
+#define PT_L2INDEX(va)	(((va) / PAGE_SIZE) % PT_NL2)
+
+struct pagetable {
+	pte_t *pt_dir[PT_NL1];		/* second-level tables, or NULL */
+};
+
+/*
+ * Let go of whatever entry PTE holds.
+ */
+static
+void
+pt_release(pte_t pte)
+{
+	unsigned slot;
+
+	KASSERT((pte & PTE_BUSY) == 0);
+	if (pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(pte));
+	}
+	else if (pte != 0) {
+		if (coremap_refcount(pte & PTE_FRAME) == 1) {
+			/* The last mapping; a copy kept in swap goes too. */
+			slot = coremap_takeslot(pte & PTE_FRAME);
+			if (slot != CM_NOSLOT) {
+				swap_free(slot);
+			}
+		}
+		coremap_free(pte & PTE_FRAME);
+	}
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NL1; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_clear(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	for (i=0; i<PT_NL1; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NL2; j++) {
+			pt_release(l2[j]);
+		}
+		kfree(l2);
+		pt->pt_dir[i] = NULL;
+	}
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	pt_clear(pt);
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+	unsigned i;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_NL2 * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_NL2; i++) {
+			l2[i] = 0;
+		}
+		pt->pt_dir[PT_L1INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2INDEX(vaddr)];
+}
+
+void
+pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *l2;
+
+	KASSERT(start <= end && end <= USERSPACETOP);
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		l2 = pt->pt_dir[PT_L1INDEX(va)];
+		if (l2 == NULL) {
+			continue;
+		}
+		pt_release(l2[PT_L2INDEX(va)]);
+		l2[PT_L2INDEX(va)] = 0;
+	}
+}
+
+int
+pt_share(struct pagetable *dst, struct pagetable *src)
+{
+	unsigned i, j;
+	pte_t *sl2, *dl2;
+
+	for (i=0; i<PT_NL1; i++) {
+		sl2 = src->pt_dir[i];
+		if (sl2 == NULL) {
+			continue;
+		}
+		dl2 = pt_lookup(dst, i << PT_L2SHIFT, true);
+		if (dl2 == NULL) {
+			return ENOMEM;
+		}
+		for (j=0; j<PT_NL2; j++) {
+			KASSERT((sl2[j] & PTE_BUSY) == 0);
+			if (sl2[j] & PTE_SWAPPED) {
+				swap_share(PTE_SLOT(sl2[j]));
+				dl2[j] = sl2[j];
+			}
+			else if (sl2[j] != 0) {
+				coremap_share(sl2[j] & PTE_FRAME,
+					      (i << PT_L2SHIFT) | (j * PAGE_SIZE));
+				dl2[j] = sl2[j];
+			}
+		}
+	}
+	return 0;
+}
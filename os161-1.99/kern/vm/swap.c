@@ -0,0 +1,181 @@
+/*
+ * Swap space. See swap.h for the overview.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vn;		/* swap device, or NULL */
+static unsigned swap_nslots;		/* # of slots on it */
+
+/* swap_lock protects the following. */
+static struct lock *swap_lock;
+static uint16_t *swap_refs;		/* references to each slot */
+static unsigned swap_hint;		/* where to start looking */
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_PATH;	/* vfs_open scribbles on it */
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vn);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_PATH, strerror(result));
+		swap_vn = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vn, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_PATH, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots > SWAP_MAXSLOTS) {
+		swap_nslots = SWAP_MAXSLOTS;
+	}
+
+	swap_lock = lock_create("swap");
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_lock == NULL || swap_refs == NULL) {
+		panic("swap: out of memory\n");
+	}
+	bzero(swap_refs, swap_nslots * sizeof(swap_refs[0]));
+	swap_hint = 0;
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_PATH);
+}
+
+int
+swap_alloc(unsigned *slot, unsigned *nslots)
+{
+	unsigned i, start = 0, n;
+
+	KASSERT(*nslots > 0);
+
+	if (swap_vn == NULL) {
+		return ENOSPC;
+	}
+
+	lock_acquire(swap_lock);
+
+	/* Next fit: take the first free run after the last one. */
+	for (i=0; i<swap_nslots; i++) {
+		start = (swap_hint + i) % swap_nslots;
+		if (swap_refs[start] == 0) {
+			break;
+		}
+	}
+	if (i == swap_nslots) {
+		lock_release(swap_lock);
+		return ENOSPC;
+	}
+
+	for (n = 0; n < *nslots && start + n < swap_nslots &&
+		     swap_refs[start + n] == 0; n++) {
+		swap_refs[start + n] = 1;
+	}
+	swap_hint = start + n;
+
+	lock_release(swap_lock);
+
+	*slot = start;
+	*nslots = n;
+	return 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	lock_release(swap_lock);
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	lock_acquire(swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	lock_release(swap_lock);
+}
+
+/*
+ * Move NPAGES pages between the kernel buffers BUFS and the slots
+ * starting at SLOT.
+ */
+static
+int
+swap_io(unsigned slot, void *const *bufs, unsigned npages, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	KASSERT(slot + npages <= swap_nslots);
+
+	for (i=0; i<npages; i++) {
+		iov[i].iov_kbase = bufs[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	result = (rw == UIO_READ) ? VOP_READ(swap_vn, &u) :
+		VOP_WRITE(swap_vn, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("swap: short %s at slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	void *buf;
+
+	buf = (void *)PADDR_TO_KVADDR(paddr);
+	return swap_io(slot, &buf, 1, UIO_READ);
+}
+
+int
+swap_write(unsigned slot, const paddr_t *paddrs, unsigned npages)
+{
+	void *bufs[SWAP_CLUSTER];
+	unsigned i;
+
+	KASSERT(npages <= SWAP_CLUSTER);
+	for (i=0; i<npages; i++) {
+		bufs[i] = (void *)PADDR_TO_KVADDR(paddrs[i]);
+	}
+	return swap_io(slot, bufs, npages, UIO_WRITE);
+}
@@ -15,11 +15,23 @@
 #include <synch.h>
 #include <spl.h>
 #include <uw-vmstats.h>
-
+#include "opt-A3.h"
+#if OPT_A3
+#include <counter.h>
+#endif
+
+#if OPT_A3
+/*
+ * The counts are per-cpu counters (counter.h), CNT_VMSTAT onwards,
+ * so incrementing takes no lock and the '_' functions are the same
+ * as the others.
+ */
+#else
 /* Counters for tracking statistics */
 static unsigned int stats_counts[VMSTAT_COUNT];
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+#endif
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -41,15 +53,22 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
+#if OPT_A3
+    _vmstats_inc(index);
+#else
     spinlock_acquire(&stats_lock);
       _vmstats_inc(index);
     spinlock_release(&stats_lock);
+#endif
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
+#if OPT_A3
+  _vmstats_init();
+#else
   /* Although the spinlock is initialized at declaration time we do it here
    * again in case we want use/reset these stats repeatedly without shutting down the kernel.
    */
@@ -58,6 +77,7 @@ vmstats_init(void)
   spinlock_acquire(&stats_lock);
     _vmstats_init();
   spinlock_release(&stats_lock);
+#endif
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,14 +85,20 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
+#if OPT_A3
+  counter_inc(CNT_VMSTAT + index);
+#else
   stats_counts[index]++;
+#endif
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
+#if !OPT_A3
   int i = 0;
+#endif
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,9 +106,13 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
+#if OPT_A3
+  counter_reset(CNT_VMSTAT, VMSTAT_COUNT);
+#else
   for (i=0; i<VMSTAT_COUNT; i++) {
     stats_counts[i] = 0;
   }
+#endif
 
 }
 
@@ -102,6 +132,13 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+#if OPT_A3
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_counts[i] = counter_read(CNT_VMSTAT + i);
+  }
+#endif
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {